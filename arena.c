@@ -0,0 +1,189 @@
+#include <string.h>
+
+#include <avro.h>
+
+#include "arena.h"
+
+#define ALIGN(size) (((size) + 15) & ~(size_t)15)
+
+// every avro allocation is prefixed with its owner arena (NULL for heap)
+typedef struct alloc_header {
+    arena_t *arena;
+    size_t size;
+} alloc_header_t;
+
+#define ALLOC_HEADER_SIZE ALIGN(sizeof(alloc_header_t))
+
+// arena the current thread decodes into, and its pool of idle arenas
+static __thread arena_t *current_arena = NULL;
+static __thread arena_pool_t *pool = NULL;
+
+static arena_chunk_t* arena_chunk_new(size_t size) {
+    if (size < ARENA_CHUNK_SIZE) {
+        size = ARENA_CHUNK_SIZE;
+    }
+    arena_chunk_t *chunk = malloc(sizeof(arena_chunk_t) + size);
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
+
+static void arena_free(arena_t *arena) {
+    arena_chunk_t *chunk = arena->chunks;
+    while (chunk) {
+        arena_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(arena->block);
+    free(arena);
+}
+
+// keep only the oldest chunk and return arena to its pool
+static void arena_recycle(arena_t *arena) {
+    arena_chunk_t *chunk = arena->chunks;
+    while (chunk->next) {
+        arena_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    chunk->used = 0;
+    arena->chunks = chunk;
+
+    arena_pool_t *p = arena->pool;
+    uv_mutex_lock(&p->mutex);
+    if (p->count < ARENA_POOL_SIZE) {
+        arena->next = p->free;
+        p->free = arena;
+        p->count++;
+        arena = NULL;
+    }
+    uv_mutex_unlock(&p->mutex);
+
+    if (arena) {
+        arena_free(arena);
+    }
+}
+
+arena_t* arena_get() {
+    if (!pool) {
+        pool = malloc(sizeof(arena_pool_t));
+        uv_mutex_init(&pool->mutex);
+        pool->count = 0;
+        pool->free = NULL;
+    }
+
+    uv_mutex_lock(&pool->mutex);
+    arena_t *arena = pool->free;
+    if (arena) {
+        pool->free = arena->next;
+        pool->count--;
+    }
+    uv_mutex_unlock(&pool->mutex);
+
+    if (!arena) {
+        arena = malloc(sizeof(arena_t));
+        arena->chunks = arena_chunk_new(ARENA_CHUNK_SIZE);
+        arena->pool = pool;
+        arena->block = NULL;
+        arena->block_cap = 0;
+    }
+    arena->next = NULL;
+    // reference held by the decoder until arena_leave
+    arena->refs = 1;
+    return arena;
+}
+
+void arena_enter(arena_t *arena) {
+    current_arena = arena;
+}
+
+void arena_leave(arena_t *arena) {
+    current_arena = NULL;
+    arena_unref(arena);
+}
+
+void* arena_alloc(arena_t *arena, size_t size) {
+    size = ALIGN(size);
+    arena_chunk_t *chunk = arena->chunks;
+    if (chunk->size - chunk->used < size) {
+        chunk = arena_chunk_new(size);
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+    void *res = chunk->data + chunk->used;
+    chunk->used += size;
+    __sync_add_and_fetch(&arena->refs, 1);
+    return res;
+}
+
+void arena_unref(arena_t *arena) {
+    if (__sync_sub_and_fetch(&arena->refs, 1) == 0) {
+        arena_recycle(arena);
+    }
+}
+
+static void release(alloc_header_t *header) {
+    if (header->arena) {
+        arena_unref(header->arena);
+    } else {
+        free(header);
+    }
+}
+
+static alloc_header_t* allocate(size_t size) {
+    alloc_header_t *header;
+    if (current_arena) {
+        header = arena_alloc(current_arena, ALLOC_HEADER_SIZE + size);
+        header->arena = current_arena;
+    } else {
+        header = malloc(ALLOC_HEADER_SIZE + size);
+        header->arena = NULL;
+    }
+    header->size = size;
+    return header;
+}
+
+// avro allocator: arena-backed while a block is being decoded, heap otherwise
+static void* arena_allocator(void *user_data, void *ptr, size_t osize, size_t nsize) {
+    alloc_header_t *header = ptr ? (alloc_header_t *)((char *)ptr - ALLOC_HEADER_SIZE) : NULL;
+
+    if (nsize == 0) {
+        if (header) {
+            release(header);
+        }
+        return NULL;
+    }
+
+    if (!header) {
+        return (char *)allocate(nsize) + ALLOC_HEADER_SIZE;
+    }
+
+    if (!header->arena && !current_arena) {
+        header = realloc(header, ALLOC_HEADER_SIZE + nsize);
+        header->size = nsize;
+        return (char *)header + ALLOC_HEADER_SIZE;
+    }
+
+    // grow the last allocation of the current chunk in place
+    if (header->arena && header->arena == current_arena) {
+        arena_chunk_t *chunk = current_arena->chunks;
+        char *end = (char *)ptr + ALIGN(header->size);
+        if (end == chunk->data + chunk->used &&
+            (char *)ptr + ALIGN(nsize) <= chunk->data + chunk->size) {
+            chunk->used += ALIGN(nsize) - ALIGN(header->size);
+            header->size = nsize;
+            return ptr;
+        }
+    }
+
+    alloc_header_t *res = allocate(nsize);
+    memcpy((char *)res + ALLOC_HEADER_SIZE, ptr, header->size < nsize ? header->size : nsize);
+    release(header);
+    return (char *)res + ALLOC_HEADER_SIZE;
+}
+
+void arena_install() {
+    avro_set_allocator(arena_allocator, NULL);
+}
@@ -0,0 +1,45 @@
+#ifndef LAQ_ARENA_H
+#define LAQ_ARENA_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <uv.h>
+
+#define ARENA_CHUNK_SIZE 256 * 1024
+#define ARENA_POOL_SIZE 8
+
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size, used;
+    char data[] __attribute__((aligned(16)));
+} arena_chunk_t;
+
+typedef struct arena_pool arena_pool_t;
+
+// bump-pointer arena, recycled once every allocation from it is freed
+typedef struct arena {
+    int64_t refs;
+    arena_chunk_t *chunks;
+    arena_pool_t *pool;
+    struct arena *next;
+    // decoded block the records reference, kept across recycles
+    char *block;
+    size_t block_cap;
+} arena_t;
+
+// idle arenas of one worker
+struct arena_pool {
+    uv_mutex_t mutex;
+    uint16_t count;
+    arena_t *free;
+};
+
+void arena_install();
+arena_t* arena_get();
+void arena_enter(arena_t *arena);
+void arena_leave(arena_t *arena);
+void* arena_alloc(arena_t *arena, size_t size);
+void arena_unref(arena_t *arena);
+
+#endif
@@ -0,0 +1,134 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "utils.h"
+
+cache_t* cache_new(const char *dir, const char *query, size_t query_len) {
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Can't create cache dir %s.\n", dir);
+        return NULL;
+    }
+
+    cache_t *cache = malloc(sizeof(cache_t));
+    cache->dir = strdup(dir);
+    cache->query_hash = hash_bytes(query, query_len, 0);
+    return cache;
+}
+
+void cache_free(cache_t *cache) {
+    free(cache->dir);
+    free(cache);
+}
+
+// "path<TAB>inode<TAB>size<TAB>mtime<TAB>ctime<TAB>query" line, NULL if
+// the file can't be stat'ed
+char* cache_key(cache_t *cache, const char *path) {
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return NULL;
+    }
+
+    char *key = NULL;
+    size_t key_len = 0;
+    FILE *fp = open_memstream(&key, &key_len);
+    fprintf(fp, "%s\t%llu\t%lld\t%lld\t%lld\t%016llx", path,
+            (unsigned long long)st.st_ino, (long long)st.st_size,
+            (long long)st.st_mtime, (long long)st.st_ctime,
+            (unsigned long long)cache->query_hash);
+    fclose(fp);
+    return key;
+}
+
+static char* cache_path(cache_t *cache, const char *key) {
+    size_t len = strlen(cache->dir) + 1 + 16 + 1;
+    char *path = malloc(len);
+    snprintf(path, len, "%s/%016llx", cache->dir,
+             (unsigned long long)hash_bytes(key, strlen(key), 0));
+    return path;
+}
+
+// cache file: magic and key line, then the handler output as is
+bool cache_fetch(cache_t *cache, const char *key, FILE *out) {
+    char *path = cache_path(cache, key);
+    FILE *fp = fopen(path, "rb");
+    free(path);
+    if (!fp) {
+        return false;
+    }
+
+    char *line = NULL;
+    size_t line_cap = 0;
+    bool hit = false;
+    if (getline(&line, &line_cap, fp) > 0) {
+        line[strcspn(line, "\n")] = 0;
+        hit = strncmp(line, CACHE_MAGIC "\t", sizeof(CACHE_MAGIC)) == 0 &&
+            strcmp(line + sizeof(CACHE_MAGIC), key) == 0;
+    }
+    free(line);
+
+    if (hit) {
+        char buf[64 * 1024];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+            fwrite(buf, 1, n, out);
+        }
+    }
+    fclose(fp);
+
+    return hit;
+}
+
+static char* cache_tmp_path(cache_t *cache, const char *key) {
+    char *path = cache_path(cache, key);
+    size_t tmp_len = strlen(path) + 5;
+    char *tmp_path = malloc(tmp_len);
+    snprintf(tmp_path, tmp_len, "%s.tmp", path);
+    free(path);
+    return tmp_path;
+}
+
+// temporary cache file the handler output is captured to, so it never has
+// to fit in memory; NULL if it can't be created
+FILE* cache_open(cache_t *cache, const char *key) {
+    char *tmp_path = cache_tmp_path(cache, key);
+    FILE *fp = fopen(tmp_path, "w+b");
+    if (fp) {
+        fprintf(fp, "%s\t%s\n", CACHE_MAGIC, key);
+    } else {
+        fprintf(stderr, "Can't write cache file %s.\n", tmp_path);
+    }
+    free(tmp_path);
+    return fp;
+}
+
+// copy captured output to out (if any), then move the cache file into
+// place, or drop it when not keeping the output (file failed to scan)
+void cache_commit(cache_t *cache, const char *key, FILE *fp, FILE *out, bool keep) {
+    bool ok = fflush(fp) == 0 && fseek(fp, 0, SEEK_SET) == 0;
+
+    char *line = NULL;
+    size_t line_cap = 0;
+    if (ok && out && getline(&line, &line_cap, fp) > 0) {
+        char buf[64 * 1024];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+            fwrite(buf, 1, n, out);
+        }
+        ok = !ferror(fp);
+    }
+    free(line);
+
+    char *tmp_path = cache_tmp_path(cache, key);
+    if (fclose(fp) == 0 && ok && keep) {
+        char *path = cache_path(cache, key);
+        rename(tmp_path, path);
+        free(path);
+    } else {
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+}
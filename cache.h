@@ -0,0 +1,23 @@
+#ifndef LAQ_CACHE_H
+#define LAQ_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define CACHE_MAGIC "laq-cache 1"
+
+// on-disk per-file handler output, keyed by file identity and query
+typedef struct cache {
+    char *dir;
+    uint64_t query_hash;
+} cache_t;
+
+cache_t* cache_new(const char *dir, const char *query, size_t query_len);
+void cache_free(cache_t *cache);
+char* cache_key(cache_t *cache, const char *path);
+bool cache_fetch(cache_t *cache, const char *key, FILE *out);
+FILE* cache_open(cache_t *cache, const char *key);
+void cache_commit(cache_t *cache, const char *key, FILE *fp, FILE *out, bool keep);
+
+#endif
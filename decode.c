@@ -0,0 +1,461 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "decode.h"
+
+static inline int decode_varint(cursor_t *cursor, int64_t *res) {
+    uint64_t value = 0;
+    uint8_t b;
+    int offset = 0;
+    do {
+        if (cursor->pos == cursor->end || offset == 10) {
+            return -1;
+        }
+        b = *cursor->pos++;
+        value |= (uint64_t) (b & 0x7F) << (7 * offset);
+        ++offset;
+    }
+    while (b & 0x80);
+    *res = ((value >> 1) ^ -(value & 1));
+    return 0;
+}
+
+// (pointer, length) view into the block
+static inline int decode_view(cursor_t *cursor, char **res, int64_t *len) {
+    if (decode_varint(cursor, len) != 0 || *len < 0 || *len > cursor->end - cursor->pos) {
+        return -1;
+    }
+    *res = cursor->pos;
+    cursor->pos += *len;
+    return 0;
+}
+
+// string view, NUL-terminated in place: the bytes are shifted over their
+// own length prefix, which is always at least one byte long
+static inline int decode_cstring(cursor_t *cursor, char **res, int64_t *len) {
+    char *start = cursor->pos;
+    char *val = NULL;
+    if (decode_view(cursor, &val, len) != 0) {
+        return -1;
+    }
+    memmove(start, val, *len);
+    start[*len] = 0;
+    *res = start;
+    return 0;
+}
+
+static inline int decode_fixed(cursor_t *cursor, void *dst, size_t len) {
+    if (len > cursor->end - cursor->pos) {
+        return -1;
+    }
+    // avro is little-endian, as are all supported hosts
+    memcpy(dst, cursor->pos, len);
+    cursor->pos += len;
+    return 0;
+}
+
+// array and map items come in blocks terminated by an empty one
+static inline int decode_block_count(cursor_t *cursor, int64_t *count) {
+    if (decode_varint(cursor, count) != 0) {
+        return -1;
+    }
+    if (*count < 0) {
+        int64_t block_size = 0;
+        *count = -*count;
+        return decode_varint(cursor, &block_size);
+    }
+    return 0;
+}
+
+// CRC-64-AVRO (Rabin) fingerprint; the spec applies it to the parsing
+// canonical form, here it is taken over the writer schema text
+static uint64_t fingerprint_table[256];
+static uv_once_t fingerprint_once = UV_ONCE_INIT;
+
+static void init_fingerprint_table() {
+    for (int i = 0; i < 256; i++) {
+        uint64_t fp = i;
+        for (int j = 0; j < 8; j++) {
+            fp = (fp >> 1) ^ (FINGERPRINT_EMPTY & -(fp & 1));
+        }
+        fingerprint_table[i] = fp;
+    }
+}
+
+uint64_t schema_fingerprint(const char *buf, size_t len) {
+    uv_once(&fingerprint_once, init_fingerprint_table);
+
+    uint64_t fp = FINGERPRINT_EMPTY;
+    for (size_t i = 0; i < len; i++) {
+        fp = (fp >> 8) ^ fingerprint_table[(fp ^ (uint8_t)buf[i]) & 0xff];
+    }
+    return fp;
+}
+
+// compiler
+typedef struct named {
+    avro_schema_t schema;
+    uint32_t pc;
+} named_t;
+
+typedef struct compiler {
+    program_t *program;
+    named_t *named;
+    size_t named_count, named_cap;
+} compiler_t;
+
+static uint32_t emit(program_t *program, uint8_t code, uint32_t arg) {
+    if (program->len == program->cap) {
+        program->cap = program->cap ? program->cap * 2 : 64;
+        program->ops = realloc(program->ops, program->cap * sizeof(op_t));
+    }
+    program->ops[program->len] = (op_t) {.code = code, .arg = arg, .end = 0};
+    return program->len++;
+}
+
+static void add_named(compiler_t *compiler, avro_schema_t schema, uint32_t pc) {
+    if (compiler->named_count == compiler->named_cap) {
+        compiler->named_cap = compiler->named_cap ? compiler->named_cap * 2 : 16;
+        compiler->named = realloc(compiler->named, compiler->named_cap * sizeof(named_t));
+    }
+    compiler->named[compiler->named_count++] = (named_t) {.schema = schema, .pc = pc};
+}
+
+static int compile(compiler_t *compiler, avro_schema_t schema) {
+    program_t *program = compiler->program;
+    uint32_t pc = 0;
+
+    switch (avro_typeof(schema)) {
+    case AVRO_NULL: pc = emit(program, OP_NULL, 0); break;
+    case AVRO_BOOLEAN: pc = emit(program, OP_BOOLEAN, 0); break;
+    case AVRO_INT32: pc = emit(program, OP_INT, 0); break;
+    case AVRO_INT64: pc = emit(program, OP_LONG, 0); break;
+    case AVRO_FLOAT: pc = emit(program, OP_FLOAT, 0); break;
+    case AVRO_DOUBLE: pc = emit(program, OP_DOUBLE, 0); break;
+    case AVRO_STRING: pc = emit(program, OP_STRING, 0); break;
+    case AVRO_BYTES: pc = emit(program, OP_BYTES, 0); break;
+
+    case AVRO_FIXED:
+        pc = emit(program, OP_FIXED, avro_schema_fixed_size(schema));
+        add_named(compiler, schema, pc);
+        break;
+
+    case AVRO_ENUM:
+        pc = emit(program, OP_ENUM, 0);
+        add_named(compiler, schema, pc);
+        break;
+
+    case AVRO_RECORD:
+    {
+        size_t field_count = avro_schema_record_size(schema);
+        pc = emit(program, OP_RECORD, field_count);
+        add_named(compiler, schema, pc);
+        for (int i = 0; i < field_count; i++) {
+            if (compile(compiler, avro_schema_record_field_get_by_index(schema, i)) != 0) {
+                return -1;
+            }
+        }
+        break;
+    }
+
+    case AVRO_ARRAY:
+        pc = emit(program, OP_ARRAY, 0);
+        if (compile(compiler, avro_schema_array_items(schema)) != 0) {
+            return -1;
+        }
+        break;
+
+    case AVRO_MAP:
+        pc = emit(program, OP_MAP, 0);
+        if (compile(compiler, avro_schema_map_values(schema)) != 0) {
+            return -1;
+        }
+        break;
+
+    case AVRO_UNION:
+    {
+        size_t branch_count = avro_schema_union_size(schema);
+        pc = emit(program, OP_UNION, branch_count);
+        for (int i = 0; i < branch_count; i++) {
+            if (compile(compiler, avro_schema_union_branch(schema, i)) != 0) {
+                return -1;
+            }
+        }
+        break;
+    }
+
+    case AVRO_LINK:
+    {
+        // named type used again (possibly recursively), jump to its code
+        avro_schema_t target = avro_schema_link_target(schema);
+        size_t i = 0;
+        while (i < compiler->named_count && compiler->named[i].schema != target) {
+            i++;
+        }
+        if (i == compiler->named_count) {
+            return -1;
+        }
+        pc = emit(program, OP_LINK, compiler->named[i].pc);
+        break;
+    }
+
+    default:
+        return -1;
+    }
+
+    program->ops[pc].end = program->len;
+    return 0;
+}
+
+// program cache
+static program_t *programs = NULL;
+static uv_mutex_t programs_mutex;
+static uv_once_t programs_once = UV_ONCE_INIT;
+
+static void init_programs() {
+    uv_mutex_init(&programs_mutex);
+}
+
+static program_t* program_new(const char *schema_json, size_t schema_len, uint64_t fingerprint) {
+    avro_schema_t schema;
+    if (avro_schema_from_json_length(schema_json, schema_len, &schema)) {
+        fprintf(stderr, "Invalid schema: %s\n", avro_strerror());
+        return NULL;
+    }
+
+    program_t *program = malloc(sizeof(program_t));
+    program->fingerprint = fingerprint;
+    program->schema_json = malloc(schema_len);
+    memcpy(program->schema_json, schema_json, schema_len);
+    program->schema_len = schema_len;
+    program->schema = schema;
+    program->ops = NULL;
+    program->len = 0;
+    program->cap = 0;
+
+    compiler_t compiler = {.program = program, .named = NULL, .named_count = 0, .named_cap = 0};
+    int rval = compile(&compiler, schema);
+    free(compiler.named);
+    if (rval != 0) {
+        fprintf(stderr, "Unsupported schema.\n");
+        free(program->ops);
+        free(program->schema_json);
+        avro_schema_decref(schema);
+        free(program);
+        return NULL;
+    }
+
+    program->iface = avro_generic_class_from_schema(schema);
+    return program;
+}
+
+// compiled program for writer schema, shared by all files with the same schema
+program_t* program_get(const char *schema_json, size_t schema_len) {
+    uv_once(&programs_once, init_programs);
+    uint64_t fingerprint = schema_fingerprint(schema_json, schema_len);
+
+    uv_mutex_lock(&programs_mutex);
+    program_t *program = programs;
+    while (program && (program->fingerprint != fingerprint ||
+                       program->schema_len != schema_len ||
+                       memcmp(program->schema_json, schema_json, schema_len) != 0)) {
+        program = program->next;
+    }
+    if (!program) {
+        program = program_new(schema_json, schema_len, fingerprint);
+        if (program) {
+            program->next = programs;
+            programs = program;
+        }
+    }
+    uv_mutex_unlock(&programs_mutex);
+
+    return program;
+}
+
+// strings and bytes reference the block memory instead of being copied,
+// they are valid while the block is alive
+static int execute(const op_t *ops, uint32_t pc, cursor_t *cursor, avro_value_t *dest) {
+    const op_t *op = &ops[pc];
+    switch (op->code) {
+    case OP_NULL:
+        return avro_value_set_null(dest);
+
+    case OP_BOOLEAN:
+    {
+        uint8_t val = 0;
+        if (decode_fixed(cursor, &val, 1) != 0) {
+            return -1;
+        }
+        return avro_value_set_boolean(dest, val);
+    }
+
+    case OP_INT:
+    {
+        int64_t val = 0;
+        if (decode_varint(cursor, &val) != 0) {
+            return -1;
+        }
+        return avro_value_set_int(dest, (int32_t)val);
+    }
+
+    case OP_LONG:
+    {
+        int64_t val = 0;
+        if (decode_varint(cursor, &val) != 0) {
+            return -1;
+        }
+        return avro_value_set_long(dest, val);
+    }
+
+    case OP_FLOAT:
+    {
+        float val = 0;
+        if (decode_fixed(cursor, &val, sizeof(val)) != 0) {
+            return -1;
+        }
+        return avro_value_set_float(dest, val);
+    }
+
+    case OP_DOUBLE:
+    {
+        double val = 0;
+        if (decode_fixed(cursor, &val, sizeof(val)) != 0) {
+            return -1;
+        }
+        return avro_value_set_double(dest, val);
+    }
+
+    case OP_STRING:
+    {
+        char *val = NULL;
+        int64_t len = 0;
+        avro_wrapped_buffer_t buf;
+        if (decode_cstring(cursor, &val, &len) != 0) {
+            return -1;
+        }
+        avro_wrapped_buffer_new(&buf, val, len + 1);
+        return avro_value_give_string_len(dest, &buf);
+    }
+
+    case OP_BYTES:
+    {
+        char *val = NULL;
+        int64_t len = 0;
+        avro_wrapped_buffer_t buf;
+        if (decode_view(cursor, &val, &len) != 0) {
+            return -1;
+        }
+        avro_wrapped_buffer_new(&buf, val, len);
+        return avro_value_give_bytes(dest, &buf);
+    }
+
+    case OP_FIXED:
+    {
+        avro_wrapped_buffer_t buf;
+        if (op->arg > cursor->end - cursor->pos) {
+            return -1;
+        }
+        avro_wrapped_buffer_new(&buf, cursor->pos, op->arg);
+        cursor->pos += op->arg;
+        return avro_value_give_fixed(dest, &buf);
+    }
+
+    case OP_ENUM:
+    {
+        int64_t val = 0;
+        if (decode_varint(cursor, &val) != 0) {
+            return -1;
+        }
+        return avro_value_set_enum(dest, (int)val);
+    }
+
+    case OP_RECORD:
+    {
+        uint32_t field_pc = pc + 1;
+        for (uint32_t i = 0; i < op->arg; i++) {
+            avro_value_t field;
+            avro_value_get_by_index(dest, i, &field, NULL);
+            if (execute(ops, field_pc, cursor, &field) != 0) {
+                return -1;
+            }
+            field_pc = ops[field_pc].end;
+        }
+        return 0;
+    }
+
+    case OP_ARRAY:
+    {
+        int64_t count = 0;
+        while (1) {
+            if (decode_block_count(cursor, &count) != 0) {
+                return -1;
+            }
+            if (count == 0) {
+                break;
+            }
+            for (int64_t i = 0; i < count; i++) {
+                avro_value_t item;
+                avro_value_append(dest, &item, NULL);
+                if (execute(ops, pc + 1, cursor, &item) != 0) {
+                    return -1;
+                }
+            }
+        }
+        return 0;
+    }
+
+    case OP_MAP:
+    {
+        int64_t count = 0;
+        while (1) {
+            if (decode_block_count(cursor, &count) != 0) {
+                return -1;
+            }
+            if (count == 0) {
+                break;
+            }
+            for (int64_t i = 0; i < count; i++) {
+                char *key = NULL;
+                int64_t key_len = 0;
+                avro_value_t item;
+                if (decode_cstring(cursor, &key, &key_len) != 0) {
+                    return -1;
+                }
+                avro_value_add(dest, key, &item, NULL, NULL);
+                if (execute(ops, pc + 1, cursor, &item) != 0) {
+                    return -1;
+                }
+            }
+        }
+        return 0;
+    }
+
+    case OP_UNION:
+    {
+        int64_t index = 0;
+        avro_value_t branch;
+        if (decode_varint(cursor, &index) != 0 || index < 0 || index >= op->arg) {
+            return -1;
+        }
+        if (avro_value_set_branch(dest, (int)index, &branch) != 0) {
+            return -1;
+        }
+        uint32_t branch_pc = pc + 1;
+        for (int64_t i = 0; i < index; i++) {
+            branch_pc = ops[branch_pc].end;
+        }
+        return execute(ops, branch_pc, cursor, &branch);
+    }
+
+    case OP_LINK:
+        return execute(ops, op->arg, cursor, dest);
+
+    default:
+        return -1;
+    }
+}
+
+int program_decode(program_t *program, cursor_t *cursor, avro_value_t *dest) {
+    return execute(program->ops, 0, cursor, dest);
+}
@@ -0,0 +1,60 @@
+#ifndef LAQ_DECODE_H
+#define LAQ_DECODE_H
+
+#include <stdint.h>
+
+#include <avro.h>
+#include <uv.h>
+
+#define FINGERPRINT_EMPTY 0xc15d213aa4d7a795ULL
+
+// decode program opcodes
+#define OP_NULL 0
+#define OP_BOOLEAN 1
+#define OP_INT 2
+#define OP_LONG 3
+#define OP_FLOAT 4
+#define OP_DOUBLE 5
+#define OP_STRING 6
+#define OP_BYTES 7
+#define OP_FIXED 8
+#define OP_ENUM 9
+#define OP_RECORD 10
+#define OP_ARRAY 11
+#define OP_MAP 12
+#define OP_UNION 13
+#define OP_LINK 14
+
+// read position inside a decoded (inflated) block
+typedef struct cursor {
+    char *pos, *end;
+} cursor_t;
+
+// ops are laid out in schema pre-order, children follow their parent and
+// end is the pc right after the whole subtree
+typedef struct op {
+    uint8_t code;
+    // field/branch count, fixed size or link target
+    uint32_t arg;
+    uint32_t end;
+} op_t;
+
+// writer schema compiled to a flat decode program. It saves the schema
+// parse per file and the type queries per value; records are still
+// generic values, filled through their avro_value_iface_t.
+typedef struct program {
+    uint64_t fingerprint;
+    char *schema_json;
+    size_t schema_len;
+    avro_schema_t schema;
+    avro_value_iface_t *iface;
+    op_t *ops;
+    uint32_t len, cap;
+    struct program *next;
+} program_t;
+
+uint64_t schema_fingerprint(const char *buf, size_t len);
+program_t* program_get(const char *schema_json, size_t schema_len);
+int program_decode(program_t *program, cursor_t *cursor, avro_value_t *dest);
+
+#endif
@@ -0,0 +1,104 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+
+#include "filter.h"
+
+// comma separated patterns, NULL if there are none
+filter_t* filter_new(const char *patterns) {
+    filter_t *filter = malloc(sizeof(filter_t));
+    filter->count = 0;
+    filter->patterns = NULL;
+    filter->lens = NULL;
+
+    char *buf = strdup(patterns);
+    char *pattern = strtok(buf, ",");
+    while (pattern) {
+        filter->patterns = realloc(filter->patterns, (filter->count + 1) * sizeof(char *));
+        filter->lens = realloc(filter->lens, (filter->count + 1) * sizeof(size_t));
+        filter->patterns[filter->count] = strdup(pattern);
+        filter->lens[filter->count] = strlen(pattern);
+        filter->count++;
+        pattern = strtok(NULL, ",");
+    }
+    free(buf);
+
+    if (filter->count == 0) {
+        filter_free(filter);
+        return NULL;
+    }
+    return filter;
+}
+
+void filter_free(filter_t *filter) {
+    for (size_t i = 0; i < filter->count; i++) {
+        free(filter->patterns[i]);
+    }
+    free(filter->patterns);
+    free(filter->lens);
+    free(filter);
+}
+
+static bool contains(filter_t *filter, const char *data, size_t size) {
+    for (size_t i = 0; i < filter->count; i++) {
+        if (memmem(data, size, filter->patterns[i], filter->lens[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// scan raw block bytes: string values are stored verbatim, so a block
+// without a hit can't have a matching record and is skipped undecoded
+bool filter_block(filter_t *filter, const char *data, size_t size) {
+    return contains(filter, data, size);
+}
+
+// check string and bytes fields of a record
+bool filter_record(filter_t *filter, avro_value_t *value) {
+    switch (avro_value_get_type(value)) {
+    case AVRO_STRING:
+    {
+        const char *val = NULL;
+        size_t size = 0;
+        avro_value_get_string(value, &val, &size);
+        return size && contains(filter, val, size - 1);
+    }
+
+    case AVRO_BYTES:
+    {
+        const void *val = NULL;
+        size_t size = 0;
+        avro_value_get_bytes(value, &val, &size);
+        return contains(filter, val, size);
+    }
+
+    case AVRO_ARRAY:
+    case AVRO_MAP:
+    case AVRO_RECORD:
+    {
+        size_t field_count = 0;
+        avro_value_get_size(value, &field_count);
+        for (int i = 0; i < field_count; i++) {
+            avro_value_t field;
+            avro_value_get_by_index(value, i, &field, NULL);
+            if (filter_record(filter, &field)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    case AVRO_UNION:
+    {
+        avro_value_t branch;
+        if (avro_value_get_current_branch(value, &branch) != 0) {
+            return false;
+        }
+        return filter_record(filter, &branch);
+    }
+
+    default:
+        return false;
+    }
+}
@@ -0,0 +1,21 @@
+#ifndef LAQ_FILTER_H
+#define LAQ_FILTER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <avro.h>
+
+// substring filter, matches if any of the patterns is found
+typedef struct filter {
+    size_t count;
+    char **patterns;
+    size_t *lens;
+} filter_t;
+
+filter_t* filter_new(const char *patterns);
+void filter_free(filter_t *filter);
+bool filter_block(filter_t *filter, const char *data, size_t size);
+bool filter_record(filter_t *filter, avro_value_t *value);
+
+#endif
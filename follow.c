@@ -0,0 +1,206 @@
+#include <fcntl.h>
+#include <glob.h>
+#include <libgen.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "follow.h"
+#include "stream.h"
+
+static follow_entry_t* follow_state_get(follow_state_t *state, const char *path) {
+    for (size_t i = 0; i < state->count; i++) {
+        if (strcmp(state->entries[i].path, path) == 0) {
+            return &state->entries[i];
+        }
+    }
+
+    if (state->count == state->cap) {
+        state->cap = state->cap ? state->cap * 2 : 16;
+        state->entries = realloc(state->entries, state->cap * sizeof(follow_entry_t));
+    }
+    follow_entry_t *entry = &state->entries[state->count++];
+    entry->path = strdup(path);
+    entry->inode = 0;
+    entry->offset = 0;
+    return entry;
+}
+
+// state file: one "inode<TAB>offset<TAB>path" line per file
+follow_state_t* follow_state_load(const char *path) {
+    follow_state_t *state = malloc(sizeof(follow_state_t));
+    state->path = path ? strdup(path) : NULL;
+    state->count = 0;
+    state->cap = 0;
+    state->entries = NULL;
+
+    FILE *fp = path ? fopen(path, "r") : NULL;
+    if (!fp) {
+        return state;
+    }
+
+    char *line = NULL;
+    size_t line_cap = 0;
+    while (getline(&line, &line_cap, fp) != -1) {
+        unsigned long long inode = 0;
+        long long offset = 0;
+        int path_start = 0;
+        if (sscanf(line, "%llu\t%lld\t%n", &inode, &offset, &path_start) != 2 || !path_start) {
+            continue;
+        }
+        char *file_path = line + path_start;
+        file_path[strcspn(file_path, "\n")] = 0;
+        follow_entry_t *entry = follow_state_get(state, file_path);
+        entry->inode = inode;
+        entry->offset = offset;
+    }
+    free(line);
+    fclose(fp);
+
+    return state;
+}
+
+// checkpoint atomically: write aside, then rename over the old state
+void follow_state_save(follow_state_t *state) {
+    if (!state->path) {
+        return;
+    }
+
+    size_t tmp_len = strlen(state->path) + 5;
+    char *tmp_path = malloc(tmp_len);
+    snprintf(tmp_path, tmp_len, "%s.tmp", state->path);
+
+    FILE *fp = fopen(tmp_path, "w");
+    if (!fp) {
+        fprintf(stderr, "Can't write state file %s.\n", tmp_path);
+        free(tmp_path);
+        return;
+    }
+    for (size_t i = 0; i < state->count; i++) {
+        follow_entry_t *entry = &state->entries[i];
+        fprintf(fp, "%llu\t%lld\t%s\n",
+                (unsigned long long)entry->inode, (long long)entry->offset, entry->path);
+    }
+    fclose(fp);
+
+    if (rename(tmp_path, state->path) != 0) {
+        fprintf(stderr, "Can't write state file %s.\n", state->path);
+    }
+    free(tmp_path);
+}
+
+void follow_state_free(follow_state_t *state) {
+    for (size_t i = 0; i < state->count; i++) {
+        free(state->entries[i].path);
+    }
+    free(state->entries);
+    free(state->path);
+    free(state);
+}
+
+// read blocks appended since the last pass, returns true if file grew
+static bool follow_file(follow_state_t *state, const char *path,
+                        record_func callback, void *user_data, filter_t *filter, join_t *join) {
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return false;
+    }
+
+    follow_entry_t *entry = follow_state_get(state, path);
+    if (entry->inode != st.st_ino || st.st_size < entry->offset) {
+        // new or replaced file, start over
+        entry->inode = st.st_ino;
+        entry->offset = 0;
+    }
+    if (entry->offset && st.st_size == entry->offset) {
+        return false;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "Can't open %s.\n", path);
+        return false;
+    }
+    off_t offset = entry->offset;
+    if (read_avro_stream(fd, callback, user_data, filter, join, &offset) == STREAM_UNSUPPORTED_CODEC) {
+        fprintf(stderr, "Unsupported codec in %s.\n", path);
+    }
+    close(fd);
+
+    bool grew = offset != entry->offset;
+    entry->offset = offset;
+    return grew;
+}
+
+#ifdef __linux__
+static void watch_file(int inotify_fd, const char *path) {
+    inotify_add_watch(inotify_fd, path, IN_MODIFY | IN_CLOSE_WRITE);
+
+    // new files matching the pattern show up in the same directory
+    char *dir_path = strdup(path);
+    inotify_add_watch(inotify_fd, dirname(dir_path), IN_CREATE | IN_MOVED_TO);
+    free(dir_path);
+}
+
+static void wait_changes(int inotify_fd) {
+    if (inotify_fd == -1) {
+        sleep(FOLLOW_INTERVAL);
+        return;
+    }
+
+    struct pollfd pfd = {.fd = inotify_fd, .events = POLLIN};
+    if (poll(&pfd, 1, FOLLOW_INTERVAL * 1000) > 0) {
+        char buf[4096];
+        // give writers a moment, then drain queued events
+        usleep(100 * 1000);
+        while (read(inotify_fd, buf, sizeof(buf)) > 0);
+    }
+}
+#endif
+
+// process new complete blocks of matching files forever, checkpointing
+// the offset of the last processed sync marker per file
+void follow_files(char *input, const char *state_path, record_func callback, follow_sync_func sync,
+                  void *user_data, filter_t *filter, join_t *join) {
+    follow_state_t *state = follow_state_load(state_path);
+
+#ifdef __linux__
+    int inotify_fd = inotify_init1(IN_NONBLOCK);
+#endif
+
+    while (1) {
+        glob_t glob_results;
+        glob(input, GLOB_TILDE, NULL, &glob_results);
+
+        bool changed = false;
+        for (int i = 0; i < glob_results.gl_pathc; ++i) {
+            char *path = glob_results.gl_pathv[i];
+#ifdef __linux__
+            watch_file(inotify_fd, path);
+#endif
+            changed |= follow_file(state, path, callback, user_data, filter, join);
+        }
+        globfree(&glob_results);
+
+        // offsets only cover records whose output is written
+        if (changed) {
+            sync(user_data);
+            follow_state_save(state);
+        }
+
+#ifdef __linux__
+        wait_changes(inotify_fd);
+#else
+        sleep(FOLLOW_INTERVAL);
+#endif
+    }
+
+    follow_state_free(state);
+}
@@ -0,0 +1,36 @@
+#ifndef LAQ_FOLLOW_H
+#define LAQ_FOLLOW_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "filter.h"
+#include "join.h"
+#include "utils.h"
+
+// seconds between rescans when no change notification arrives
+#define FOLLOW_INTERVAL 5
+
+// waits until processed records are written out, runs before checkpoints
+typedef void (*follow_sync_func)(void *user_data);
+
+// processed part of one followed file
+typedef struct follow_entry {
+    char *path;
+    ino_t inode;
+    off_t offset;
+} follow_entry_t;
+
+typedef struct follow_state {
+    char *path;
+    size_t count, cap;
+    follow_entry_t *entries;
+} follow_state_t;
+
+follow_state_t* follow_state_load(const char *path);
+void follow_state_save(follow_state_t *state);
+void follow_state_free(follow_state_t *state);
+void follow_files(char *input, const char *state_path, record_func callback, follow_sync_func sync,
+                  void *user_data, filter_t *filter, join_t *join);
+
+#endif
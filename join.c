@@ -0,0 +1,535 @@
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "join.h"
+#include "stream.h"
+#include "utils.h"
+
+// table builder: column names, then key and columns of every row
+typedef struct join_builder {
+    uint32_t column_count;
+    bool has_columns;
+    char *strings;
+    size_t strings_len, strings_cap;
+    join_string_t *fields;
+    size_t field_count, field_cap;
+} join_builder_t;
+
+static void add_field(join_builder_t *builder, const char *val, size_t len) {
+    if (builder->strings_len + len + 1 > builder->strings_cap) {
+        while (builder->strings_len + len + 1 > builder->strings_cap) {
+            builder->strings_cap = builder->strings_cap ? builder->strings_cap * 2 : 64 * 1024;
+        }
+        builder->strings = realloc(builder->strings, builder->strings_cap);
+    }
+    if (builder->field_count == builder->field_cap) {
+        builder->field_cap = builder->field_cap ? builder->field_cap * 2 : 1024;
+        builder->fields = realloc(builder->fields, builder->field_cap * sizeof(join_string_t));
+    }
+
+    memcpy(builder->strings + builder->strings_len, val, len);
+    builder->strings[builder->strings_len + len] = 0;
+    builder->fields[builder->field_count++] = (join_string_t) {.offset = builder->strings_len, .len = len};
+    builder->strings_len += len + 1;
+}
+
+// csv/tsv: header line names the columns, first column is the key.
+// Fields are split on the delimiter, quoting is not supported.
+static void load_csv(join_builder_t *builder, FILE *fp, char delim) {
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t line_len;
+    while ((line_len = getline(&line, &line_cap, fp)) != -1) {
+        while (line_len && (line[line_len - 1] == '\n' || line[line_len - 1] == '\r')) {
+            line[--line_len] = 0;
+        }
+        if (!line_len) {
+            continue;
+        }
+
+        char *field = line;
+        uint32_t count = 0;
+        while (field) {
+            char *next = strchr(field, delim);
+            size_t len = next ? (size_t)(next - field) : strlen(field);
+            if (!builder->has_columns) {
+                // key column name is not needed
+                if (count) {
+                    add_field(builder, field, len);
+                    builder->column_count++;
+                }
+            } else if (count <= builder->column_count) {
+                add_field(builder, field, len);
+            }
+            count++;
+            field = next ? next + 1 : NULL;
+        }
+
+        if (!builder->has_columns) {
+            builder->has_columns = true;
+            continue;
+        }
+        // missing trailing columns are empty
+        for (; count <= builder->column_count; count++) {
+            add_field(builder, "", 0);
+        }
+    }
+    free(line);
+}
+
+static void add_value(join_builder_t *builder, avro_value_t *value) {
+    if (avro_value_get_type(value) == AVRO_UNION) {
+        avro_value_t branch;
+        avro_value_get_current_branch(value, &branch);
+        add_value(builder, &branch);
+        return;
+    }
+
+    switch (avro_value_get_type(value)) {
+    case AVRO_STRING:
+    {
+        const char *val = NULL;
+        size_t size = 0;
+        avro_value_get_string(value, &val, &size);
+        add_field(builder, val, size ? size - 1 : 0);
+        break;
+    }
+
+    case AVRO_BYTES:
+    {
+        const void *val = NULL;
+        size_t size = 0;
+        avro_value_get_bytes(value, &val, &size);
+        add_field(builder, val, size);
+        break;
+    }
+
+    default:
+    {
+        char *buf = NULL;
+        size_t buf_len = 0;
+        FILE *prev_output = output;
+        output = open_memstream(&buf, &buf_len);
+        print_avro_value(value, 0);
+        fclose(output);
+        output = prev_output;
+        add_field(builder, buf, buf_len);
+        free(buf);
+    }
+    }
+}
+
+// avro side file: first field is the key, the rest are columns
+static void add_avro_row(avro_value_t *record, join_builder_t *builder) {
+    size_t size = 0;
+    avro_value_get_size(record, &size);
+    if (!size) {
+        return;
+    }
+
+    if (!builder->has_columns) {
+        for (int i = 1; i < size; i++) {
+            const char *field_name = NULL;
+            avro_value_t field;
+            avro_value_get_by_index(record, i, &field, &field_name);
+            add_field(builder, field_name, strlen(field_name));
+        }
+        builder->column_count = size - 1;
+        builder->has_columns = true;
+    }
+
+    for (int i = 0; i <= builder->column_count; i++) {
+        avro_value_t field;
+        avro_value_get_by_index(record, i, &field, NULL);
+        add_value(builder, &field);
+    }
+}
+
+// lay the builder out as one buffer and fill the slots
+static void join_build(join_t *join, join_builder_t *builder) {
+    uint32_t row_size = builder->column_count + 1;
+    size_t row_count = (builder->field_count - builder->column_count) / row_size;
+    uint32_t slot_count = 16;
+    while (slot_count < row_count * 2) {
+        slot_count *= 2;
+    }
+
+    size_t columns = sizeof(join_header_t);
+    size_t slots = columns + builder->column_count * sizeof(join_string_t);
+    size_t rows = slots + slot_count * sizeof(join_slot_t);
+    size_t strings = rows + row_count * row_size * sizeof(join_string_t);
+
+    join->size = strings + builder->strings_len;
+    join->data = calloc(1, join->size);
+    join->mapped = false;
+
+    join_header_t *header = (join_header_t *)join->data;
+    memcpy(header->magic, JOIN_MAGIC, sizeof(header->magic));
+    header->version = JOIN_VERSION;
+    header->byte_order = JOIN_BYTE_ORDER;
+    header->size = join->size;
+    header->column_count = builder->column_count;
+    header->slot_count = slot_count;
+    header->columns = columns;
+    header->slots = slots;
+    header->rows = rows;
+    header->row_count = row_count;
+    header->strings = strings;
+
+    join_string_t *fields = (join_string_t *)(join->data + columns);
+    for (size_t i = 0; i < builder->column_count; i++) {
+        fields[i] = builder->fields[i];
+        fields[i].offset += strings;
+    }
+    fields = (join_string_t *)(join->data + rows);
+    for (size_t i = 0; i < row_count * row_size; i++) {
+        fields[i] = builder->fields[builder->column_count + i];
+        fields[i].offset += strings;
+    }
+    memcpy(join->data + strings, builder->strings, builder->strings_len);
+
+    // linear probing, first row wins for duplicate keys
+    join_slot_t *slot_table = (join_slot_t *)(join->data + slots);
+    for (size_t r = 0; r < row_count; r++) {
+        join_string_t *key = &fields[r * row_size];
+        const char *key_val = join->data + key->offset;
+        uint64_t hash = hash_bytes(key_val, key->len, 0);
+        uint32_t i = hash & (slot_count - 1);
+        while (slot_table[i].row) {
+            join_string_t *other = (join_string_t *)(join->data + slot_table[i].row);
+            if (slot_table[i].hash == hash && other->len == key->len &&
+                memcmp(join->data + other->offset, key_val, key->len) == 0) {
+                break;
+            }
+            i = (i + 1) & (slot_count - 1);
+        }
+        if (!slot_table[i].row) {
+            slot_table[i].hash = hash;
+            slot_table[i].row = (char *)key - join->data;
+        }
+    }
+}
+
+// key and columns of the row, NULL if not found
+static const join_string_t* join_lookup(join_t *join, const char *key, size_t len) {
+    join_header_t *header = (join_header_t *)join->data;
+    join_slot_t *slots = (join_slot_t *)(join->data + header->slots);
+    uint32_t mask = header->slot_count - 1;
+    uint64_t hash = hash_bytes(key, len, 0);
+    for (uint32_t i = hash & mask; slots[i].row; i = (i + 1) & mask) {
+        if (slots[i].hash != hash) {
+            continue;
+        }
+        const join_string_t *row = (const join_string_t *)(join->data + slots[i].row);
+        if (row->len == len && memcmp(join->data + row->offset, key, len) == 0) {
+            return row;
+        }
+    }
+    return NULL;
+}
+
+// string lies in the string area and is NUL-terminated
+static bool join_check_string(const char *data, size_t size, const join_string_t *val) {
+    join_header_t *header = (join_header_t *)data;
+    return val->offset >= header->strings && val->offset < size &&
+        val->len < size - val->offset && data[val->offset + val->len] == 0;
+}
+
+// saved tables are trusted only once the layout join_build writes checks out
+static bool join_check(const char *data, size_t size) {
+    join_header_t *header = (join_header_t *)data;
+    if (header->version != JOIN_VERSION || header->byte_order != JOIN_BYTE_ORDER ||
+        header->size != size) {
+        return false;
+    }
+
+    uint64_t row_size = ((uint64_t)header->column_count + 1) * sizeof(join_string_t);
+    if (!header->slot_count || (header->slot_count & (header->slot_count - 1)) ||
+        header->row_count > size / row_size || header->row_count >= header->slot_count) {
+        return false;
+    }
+    if (header->columns != sizeof(join_header_t) ||
+        header->slots != header->columns + header->column_count * sizeof(join_string_t) ||
+        header->rows != header->slots + (uint64_t)header->slot_count * sizeof(join_slot_t) ||
+        header->strings != header->rows + header->row_count * row_size ||
+        header->strings > size) {
+        return false;
+    }
+
+    const join_string_t *fields = (const join_string_t *)(data + header->columns);
+    for (uint32_t i = 0; i < header->column_count; i++) {
+        if (!join_check_string(data, size, &fields[i])) {
+            return false;
+        }
+    }
+    fields = (const join_string_t *)(data + header->rows);
+    for (uint64_t i = 0; i < header->row_count * row_size / sizeof(join_string_t); i++) {
+        if (!join_check_string(data, size, &fields[i])) {
+            return false;
+        }
+    }
+
+    // slots point at row starts, and an empty one ends every probe
+    const join_slot_t *slots = (const join_slot_t *)(data + header->slots);
+    bool has_empty = false;
+    for (uint32_t i = 0; i < header->slot_count; i++) {
+        uint64_t row = slots[i].row;
+        if (!row) {
+            has_empty = true;
+        } else if (row < header->rows || row >= header->strings || (row - header->rows) % row_size) {
+            return false;
+        }
+    }
+    return has_empty;
+}
+
+static int join_map(join_t *join, int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < sizeof(join_header_t)) {
+        return -1;
+    }
+    void *data = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+    if (!join_check(data, st.st_size)) {
+        munmap(data, st.st_size);
+        return -1;
+    }
+    join->data = data;
+    join->size = st.st_size;
+    join->mapped = true;
+    return 0;
+}
+
+// column names as avro names
+static char* field_name(const char *name) {
+    size_t len = strlen(name);
+    char *res = malloc(len + 2), *p = res;
+    if (!len || isdigit(*name)) {
+        *p++ = '_';
+    }
+    for (size_t i = 0; i < len; i++) {
+        *p++ = isalnum(name[i]) ? name[i] : '_';
+    }
+    *p = 0;
+    return res;
+}
+
+// ["null", {"type": "record", "name": "join", "fields": [columns as strings]}]
+static avro_schema_t join_schema(join_t *join) {
+    join_header_t *header = (join_header_t *)join->data;
+    join_string_t *columns = (join_string_t *)(join->data + header->columns);
+
+    avro_schema_t record = avro_schema_record("join", NULL);
+    avro_schema_t string = avro_schema_string();
+    for (uint32_t i = 0; i < header->column_count; i++) {
+        char *name = field_name(join->data + columns[i].offset);
+        avro_schema_record_field_append(record, name, string);
+        free(name);
+    }
+    avro_schema_decref(string);
+
+    avro_schema_t schema = avro_schema_union();
+    avro_schema_t null = avro_schema_null();
+    avro_schema_union_append(schema, null);
+    avro_schema_union_append(schema, record);
+    avro_schema_decref(null);
+    avro_schema_decref(record);
+    return schema;
+}
+
+// "key_path=lookup_file", lookup file is a saved table, avro or csv/tsv
+join_t* join_new(const char *spec) {
+    const char *eq = strchr(spec, '=');
+    if (!eq || eq == spec || !eq[1]) {
+        fprintf(stderr, "Invalid join, expected KEY_PATH=LOOKUP_FILE.\n");
+        return NULL;
+    }
+    const char *path = eq + 1;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "Can't open %s.\n", path);
+        return NULL;
+    }
+
+    join_t *join = malloc(sizeof(join_t));
+    join->key_path = strndup(spec, eq - spec);
+    join->data = NULL;
+    join->class_count = 0;
+
+    char magic[8] = {0};
+    ssize_t magic_len = read(fd, magic, sizeof(magic));
+    lseek(fd, 0, SEEK_SET);
+
+    if (magic_len == sizeof(magic) && memcmp(magic, JOIN_MAGIC, sizeof(magic)) == 0) {
+        if (join_map(join, fd) != 0) {
+            fprintf(stderr, "Invalid join table %s.\n", path);
+            close(fd);
+            free(join->key_path);
+            free(join);
+            return NULL;
+        }
+    } else {
+        join_builder_t builder;
+        memset(&builder, 0, sizeof(builder));
+        if (magic_len >= 4 && magic[0] == 'O' && magic[1] == 'b' && magic[2] == 'j' && magic[3] == 1) {
+            if (read_avro_stream(fd, (record_func)add_avro_row, &builder, NULL, NULL, NULL) == STREAM_UNSUPPORTED_CODEC) {
+                read_avro_file_default(path, (record_func)add_avro_row, &builder);
+            }
+        } else {
+            FILE *fp = fdopen(dup(fd), "r");
+            size_t path_len = strlen(path);
+            char delim = path_len > 4 && strcmp(path + path_len - 4, ".tsv") == 0 ? '\t' : ',';
+            load_csv(&builder, fp, delim);
+            fclose(fp);
+        }
+        join_build(join, &builder);
+        free(builder.strings);
+        free(builder.fields);
+    }
+    close(fd);
+
+    join->schema = join_schema(join);
+    return join;
+}
+
+void join_free(join_t *join) {
+    for (size_t i = 0; i < join->class_count; i++) {
+        avro_value_iface_decref(join->classes[i].iface);
+        avro_schema_decref(join->classes[i].schema);
+    }
+    avro_schema_decref(join->schema);
+    if (join->mapped) {
+        munmap(join->data, join->size);
+    } else {
+        free(join->data);
+    }
+    free(join->key_path);
+    free(join);
+}
+
+int join_save(join_t *join, const char *path) {
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        fprintf(stderr, "Can't write join table %s.\n", path);
+        return -1;
+    }
+    size_t written = fwrite(join->data, 1, join->size, fp);
+    if (fclose(fp) != 0 || written != join->size) {
+        fprintf(stderr, "Can't write join table %s.\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+// class of writer record with the join field appended; the decode program
+// fills the writer fields and leaves the last one to join_record
+avro_value_iface_t* join_class(join_t *join, program_t *program) {
+    for (size_t i = 0; i < join->class_count; i++) {
+        if (join->classes[i].program == program) {
+            return join->classes[i].iface;
+        }
+    }
+
+    avro_schema_t writer = program->schema;
+    if (avro_typeof(writer) != AVRO_RECORD || join->class_count == JOIN_MAX_CLASSES) {
+        fprintf(stderr, "Unsupported schema for join.\n");
+        return NULL;
+    }
+
+    avro_schema_t schema = avro_schema_record(avro_schema_name(writer), NULL);
+    size_t field_count = avro_schema_record_size(writer);
+    for (int i = 0; i < field_count; i++) {
+        avro_schema_record_field_append(schema, avro_schema_record_field_name(writer, i),
+                                        avro_schema_record_field_get_by_index(writer, i));
+    }
+    avro_schema_record_field_append(schema, JOIN_FIELD, join->schema);
+
+    join_class_t *cls = &join->classes[join->class_count++];
+    cls->program = program;
+    cls->schema = schema;
+    cls->iface = avro_generic_class_from_schema(schema);
+    return cls->iface;
+}
+
+// set join field to null, so the record is complete before the lookup
+void join_reset(program_t *program, avro_value_t *record) {
+    avro_value_t join_value, branch;
+    avro_value_get_by_index(record, program->ops[0].arg, &join_value, NULL);
+    avro_value_set_branch(&join_value, 0, &branch);
+    avro_value_set_null(&branch);
+}
+
+// set join field to the matched row (views into the table) or null
+void join_record(join_t *join, program_t *program, avro_value_t *record) {
+    avro_value_t key, join_value, branch;
+    const join_string_t *row = NULL;
+
+    if (get_field(record, join->key_path, &key) == 0) {
+        switch (avro_value_get_type(&key)) {
+        case AVRO_STRING:
+        {
+            const char *val = NULL;
+            size_t size = 0;
+            avro_value_get_string(&key, &val, &size);
+            row = join_lookup(join, val, size ? size - 1 : 0);
+            break;
+        }
+
+        case AVRO_BYTES:
+        {
+            const void *val = NULL;
+            size_t size = 0;
+            avro_value_get_bytes(&key, &val, &size);
+            row = join_lookup(join, val, size);
+            break;
+        }
+
+        case AVRO_INT32:
+        case AVRO_INT64:
+        {
+            int64_t val = 0;
+            int32_t val32 = 0;
+            char buf[24];
+            if (avro_value_get_type(&key) == AVRO_INT32) {
+                avro_value_get_int(&key, &val32);
+                val = val32;
+            } else {
+                avro_value_get_long(&key, &val);
+            }
+            int len = snprintf(buf, sizeof(buf), "%lld", (long long)val);
+            row = join_lookup(join, buf, len);
+            break;
+        }
+
+        default:
+            break;
+        }
+    }
+
+    if (!row) {
+        join_reset(program, record);
+        return;
+    }
+
+    avro_value_get_by_index(record, program->ops[0].arg, &join_value, NULL);
+
+    join_header_t *header = (join_header_t *)join->data;
+    avro_value_set_branch(&join_value, 1, &branch);
+    for (uint32_t i = 0; i < header->column_count; i++) {
+        avro_value_t column;
+        avro_wrapped_buffer_t buf;
+        const join_string_t *val = &row[i + 1];
+        avro_value_get_by_index(&branch, i, &column, NULL);
+        avro_wrapped_buffer_new(&buf, join->data + val->offset, val->len + 1);
+        avro_value_give_string_len(&column, &buf);
+    }
+}
@@ -0,0 +1,63 @@
+#ifndef LAQ_JOIN_H
+#define LAQ_JOIN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <avro.h>
+
+#include "decode.h"
+
+#define JOIN_MAGIC "LAQJOIN1"
+#define JOIN_VERSION 1
+// written in native byte order, tells a table from another arch apart
+#define JOIN_BYTE_ORDER 0x01020304
+#define JOIN_FIELD "_join"
+#define JOIN_MAX_CLASSES 16
+
+// lookup table, one contiguous buffer of offsets so it can be saved and
+// mmapped as is:
+// header | column names | slots | rows | strings
+typedef struct join_header {
+    char magic[8];
+    uint32_t version, byte_order;
+    uint64_t size;
+    uint32_t column_count, slot_count;
+    uint64_t columns, slots, rows, row_count, strings;
+} join_header_t;
+
+// string inside the table, NUL-terminated
+typedef struct join_string {
+    uint64_t offset, len;
+} join_string_t;
+
+// open addressing slot, row 0 marks an empty one
+typedef struct join_slot {
+    uint64_t hash, row;
+} join_slot_t;
+
+// writer schema extended with the join field
+typedef struct join_class {
+    program_t *program;
+    avro_schema_t schema;
+    avro_value_iface_t *iface;
+} join_class_t;
+
+typedef struct join {
+    char *key_path;
+    char *data;
+    size_t size;
+    bool mapped;
+    avro_schema_t schema;
+    size_t class_count;
+    join_class_t classes[JOIN_MAX_CLASSES];
+} join_t;
+
+join_t* join_new(const char *spec);
+void join_free(join_t *join);
+int join_save(join_t *join, const char *path);
+avro_value_iface_t* join_class(join_t *join, program_t *program);
+void join_reset(program_t *program, avro_value_t *record);
+void join_record(join_t *join, program_t *program, avro_value_t *record);
+
+#endif
@@ -1,7 +1,10 @@
+#include <fcntl.h>
 #include <glob.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <pthread.h>
+#include <unistd.h>
 
 #include <avro.h>
 #include <luajit.h>
@@ -10,7 +13,13 @@
 #include <uv.h>
 
 #include "options.h"
+#include "arena.h"
+#include "cache.h"
+#include "filter.h"
+#include "follow.h"
+#include "join.h"
 #include "utils.h"
+#include "stream.h"
 
 /* #include "queue.h" */
 
@@ -20,30 +29,160 @@
 
 #define LUA_CB_TYPE_INLINE 1
 #define LUA_CB_TYPE_SCRIPT 2
+#define LUA_CB_TYPE_AGGREGATE 3
+
+// queued jobs before the reader waits for some to finish
+#define MAX_PENDING_JOBS 1024
 
 // default libuv loop
 uv_loop_t *loop;
 
+// queued and not yet reaped jobs
+static int pending_jobs = 0;
+
 // lua cb data
 typedef struct lua_cb_user_data {
     lua_State *L;
     uint8_t cb_ref, type;
     char *inline_script;
     char *script_path;
+    // aggregate: state of the current file and merged result
+    int state_ref, acc_ref;
 } lua_cb_user_data_t;
 
+// print replacement writing to handler output, stdout outside handlers
+// (script top level runs on the main thread)
+int lua_print(lua_State *L) {
+    FILE *out = output ? output : stdout;
+    int n = lua_gettop(L);
+    lua_getglobal(L, "tostring");
+    for (int i = 1; i <= n; i++) {
+        size_t len = 0;
+        lua_pushvalue(L, -1);
+        lua_pushvalue(L, i);
+        lua_call(L, 1, 1);
+        const char *s = lua_tolstring(L, -1, &len);
+        if (i > 1) {
+            fputc('\t', out);
+        }
+        if (s) {
+            fwrite(s, 1, len, out);
+        }
+        lua_pop(L, 1);
+    }
+    fputc('\n', out);
+    return 0;
+}
+
 void _init_lua_cb(lua_cb_user_data_t *cb_data) {
     cb_data->L = luaL_newstate();
     luaL_openlibs(cb_data->L);
     luaJIT_setmode(cb_data->L, 0, LUAJIT_MODE_ENGINE | LUAJIT_MODE_ON);
+    lua_pushcfunction(cb_data->L, lua_print);
+    lua_setglobal(cb_data->L, "print");
 }
 
-void init_lua_cb_script(lua_cb_user_data_t *cb_data, const char *script_path) {
+// aggregate script returns a table of functions instead of one:
+//   init() -> fresh state, for every file and as initial result
+//   record(state, r)
+//   merge(result, state) -> result
+//   finish(result), optional, after the last file
+// Per-file states are merged in file order and, being plain data, can be
+// cached.
+static void lua_aggregate_push(lua_cb_user_data_t *cb_data, const char *name) {
+    lua_rawgeti(cb_data->L, LUA_REGISTRYINDEX, cb_data->cb_ref);
+    lua_getfield(cb_data->L, -1, name);
+    lua_remove(cb_data->L, -2);
+}
+
+void lua_aggregate_begin(lua_cb_user_data_t *cb_data) {
+    lua_aggregate_push(cb_data, "init");
+    lua_call(cb_data->L, 0, 1);
+    cb_data->state_ref = luaL_ref(cb_data->L, LUA_REGISTRYINDEX);
+}
+
+// merge the state on top of the stack into the result, pops it
+void lua_aggregate_merge(lua_cb_user_data_t *cb_data) {
+    lua_State *L = cb_data->L;
+    lua_aggregate_push(cb_data, "merge");
+    lua_rawgeti(L, LUA_REGISTRYINDEX, cb_data->acc_ref);
+    lua_pushvalue(L, -3);
+    lua_call(L, 2, 1);
+    luaL_unref(L, LUA_REGISTRYINDEX, cb_data->acc_ref);
+    cb_data->acc_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_pop(L, 1);
+}
+
+// push the current file's state and drop its reference
+void lua_aggregate_end(lua_cb_user_data_t *cb_data) {
+    lua_rawgeti(cb_data->L, LUA_REGISTRYINDEX, cb_data->state_ref);
+    luaL_unref(cb_data->L, LUA_REGISTRYINDEX, cb_data->state_ref);
+    cb_data->state_ref = LUA_NOREF;
+}
+
+void lua_aggregate_finish(lua_cb_user_data_t *cb_data) {
+    lua_aggregate_push(cb_data, "finish");
+    if (!lua_isfunction(cb_data->L, -1)) {
+        lua_pop(cb_data->L, 1);
+        return;
+    }
+    lua_rawgeti(cb_data->L, LUA_REGISTRYINDEX, cb_data->acc_ref);
+    lua_call(cb_data->L, 1, 0);
+}
+
+// push a cached state ("return <value>"), false if it doesn't load
+bool lua_aggregate_load(lua_cb_user_data_t *cb_data, const char *buf, size_t len) {
+    lua_State *L = cb_data->L;
+    // plain data only: no bytecode, no globals
+    if (!len || buf[0] == LUA_SIGNATURE[0]) {
+        return false;
+    }
+    if (luaL_loadbuffer(L, buf, len, "=cache") != 0) {
+        lua_pop(L, 1);
+        return false;
+    }
+    lua_newtable(L);
+    lua_setfenv(L, -2);
+    if (lua_pcall(L, 0, 1, 0) != 0) {
+        lua_pop(L, 1);
+        return false;
+    }
+    return true;
+}
+
+// write the state on top of the stack, false if it isn't plain data
+bool lua_aggregate_store(lua_cb_user_data_t *cb_data, FILE *fp) {
+    fputs("return ", fp);
+    if (serialize_lua_value(cb_data->L, -1, fp, 0) != 0) {
+        return false;
+    }
+    fputc('\n', fp);
+    return true;
+}
+
+int init_lua_cb_script(lua_cb_user_data_t *cb_data, const char *script_path) {
     _init_lua_cb(cb_data);
     cb_data->script_path = strdup(script_path);
     luaL_dofile(cb_data->L, cb_data->script_path);
+    cb_data->type = lua_istable(cb_data->L, -1) ? LUA_CB_TYPE_AGGREGATE : LUA_CB_TYPE_SCRIPT;
     cb_data->cb_ref = luaL_ref(cb_data->L, LUA_REGISTRYINDEX);
-    cb_data->type = LUA_CB_TYPE_SCRIPT;
+    if (cb_data->type != LUA_CB_TYPE_AGGREGATE) {
+        return 0;
+    }
+
+    const char *names[] = {"init", "record", "merge"};
+    for (int i = 0; i < 3; i++) {
+        lua_aggregate_push(cb_data, names[i]);
+        bool valid = lua_isfunction(cb_data->L, -1);
+        lua_pop(cb_data->L, 1);
+        if (!valid) {
+            return -1;
+        }
+    }
+    lua_aggregate_begin(cb_data);
+    cb_data->acc_ref = cb_data->state_ref;
+    cb_data->state_ref = LUA_NOREF;
+    return 0;
 }
 
 void init_lua_cb_inline(lua_cb_user_data_t *cb_data, const char *inline_script) {
@@ -59,6 +198,7 @@ void free_lua_cb(lua_cb_user_data_t *cb_data) {
         free(cb_data->inline_script);
         break;
     case LUA_CB_TYPE_SCRIPT:
+    case LUA_CB_TYPE_AGGREGATE:
         free(cb_data->script_path);
         break;
     }
@@ -71,6 +211,7 @@ typedef struct worker_data {
     record_func callback;
     void *user_data;
     avro_value_t *value;
+    FILE *output;
 } worker_data_t;
 
 void cleanup_job(uv_work_t *req, int status) {
@@ -82,22 +223,31 @@ void cleanup_job(uv_work_t *req, int status) {
     free(job->value);
     free(job->user_data);
     free(job);
+    pending_jobs--;
 }
 
 void execute_job(uv_work_t *req) {
     worker_data_t *data = (worker_data_t *)req->data;
+    output = data->output;
     data->callback(data->value, data->user_data);
 }
 
+// jobs are queued and reaped on the reader thread only, so the loop is
+// never used from two threads. Reaping drops the job's record and with it
+// the arena of its block.
 void enqueue_job(worker_data_t *job) {
     uv_queue_work(loop, &job->req, execute_job, cleanup_job);
+    if (++pending_jobs >= MAX_PENDING_JOBS) {
+        uv_run(loop, UV_RUN_ONCE);
+    }
 }
 
 // callbacks
 void dump_avro_value(avro_value_t *value, void *reserved) {
     char *strval = NULL;
     avro_value_to_json(value, 0, &strval);
-    puts(strval);
+    // one call, so lines of concurrent jobs don't interleave
+    fprintf(output, "%s\n", strval);
     free(strval);
 }
 
@@ -111,11 +261,13 @@ void dump_avro_value_mt(avro_value_t *value, void *reserved) {
     worker_data_t *job = malloc(sizeof(worker_data_t));
     job->cb_type = CB_TYPE_CAT;
     job->callback = dump_avro_value;
+    job->user_data = NULL;
+    job->output = output;
 
-    // set avro value
+    // share avro value, its strings point into the block
     job->value = malloc(sizeof(avro_value_t));
-    avro_generic_value_new(value->iface, job->value);
-    avro_value_copy_fast(job->value, value);
+    *job->value = *value;
+    avro_value_incref(job->value);
 
     // set uv req data
     job->req.data = job;
@@ -123,13 +275,18 @@ void dump_avro_value_mt(avro_value_t *value, void *reserved) {
 }
 
 void field_printer(avro_value_t *value, char *field_names) {
-    char *field = strtok(field_names, ",");
+    char *fields = strdup(field_names), *saveptr = NULL;
+    char *field = strtok_r(fields, ",", &saveptr);
+    // keep the line whole, jobs on other threads share the stream
+    flockfile(output);
     while (field) {
-        print_field(value, strdup(field));
-        printf("\t");
-        field = strtok(NULL, ",");
+        print_field(value, field);
+        fputc('\t', output);
+        field = strtok_r(NULL, ",", &saveptr);
     }
-    printf("\n");
+    fputc('\n', output);
+    funlockfile(output);
+    free(fields);
 }
 
 void field_printer_mt(avro_value_t *value, char *field_names) {
@@ -142,15 +299,16 @@ void field_printer_mt(avro_value_t *value, char *field_names) {
     worker_data_t *job = malloc(sizeof(worker_data_t));
     job->cb_type = CB_TYPE_FIELD_PRINT;
     job->callback = (record_func)field_printer;
+    job->output = output;
 
     // set user data
     // TODO: cleanup
     job->user_data = strdup(field_names);
 
-    // set avro value
+    // share avro value, its strings point into the block
     job->value = malloc(sizeof(avro_value_t));
-    avro_generic_value_new(value->iface, job->value);
-    avro_value_copy_fast(job->value, value);
+    *job->value = *value;
+    avro_value_incref(job->value);
 
     // set uv req data
     job->req.data = job;
@@ -169,6 +327,13 @@ void lua_script_handler(avro_value_t *record, lua_State *L, uint8_t cb_ref) {
     lua_call(L, 1, 0);
 }
 
+void lua_aggregate_handler(avro_value_t *record, lua_cb_user_data_t *cb_data) {
+    lua_aggregate_push(cb_data, "record");
+    lua_rawgeti(cb_data->L, LUA_REGISTRYINDEX, cb_data->state_ref);
+    push_avro_value(cb_data->L, record);
+    lua_call(cb_data->L, 2, 0);
+}
+
 void lua_script_wrapper(avro_value_t *record, lua_cb_user_data_t *lua_cb_data) {
     switch (lua_cb_data->type) {
     case LUA_CB_TYPE_INLINE:
@@ -177,35 +342,413 @@ void lua_script_wrapper(avro_value_t *record, lua_cb_user_data_t *lua_cb_data) {
     case LUA_CB_TYPE_SCRIPT:
         lua_script_handler(record, lua_cb_data->L, lua_cb_data->cb_ref);
         break;
+    case LUA_CB_TYPE_AGGREGATE:
+        lua_aggregate_handler(record, lua_cb_data);
+        break;
     default:
         fprintf(stderr, "Invalid LUA handler type.\n");
     }
 }
 // end of callbacks
 
-typedef struct read_file_callback {
-    char *input;
+// query: handler with its own output, filter and cache
+typedef struct query {
     record_func callback;
     void *user_data;
+    lua_cb_user_data_t lua_cb_data;
+    filter_t *filter;
+    FILE *out;
+    cache_t *cache;
+    // per file: inactive when replayed from cache, captured when caching
+    bool active;
+    char *key;
+    FILE *capture;
+} query_t;
+
+// all queries sharing one scan
+typedef struct scan {
+    int query_count;
+    query_t queries[MAX_QUERIES];
+    // block prefilter, only when every query has a filter
+    filter_t *filter;
+    // lookup table joined to every record before the queries see it
+    join_t *join;
+} scan_t;
+
+void dispatch_record(avro_value_t *value, scan_t *scan) {
+    for (int i = 0; i < scan->query_count; i++) {
+        query_t *query = &scan->queries[i];
+        if (!query->active) {
+            continue;
+        }
+        // records were already checked against the shared prefilter
+        if (query->filter && query->filter != scan->filter &&
+            !filter_record(query->filter, value)) {
+            continue;
+        }
+        output = query->capture ? query->capture : query->out;
+        query->callback(value, query->user_data);
+    }
+}
+
+// records not checked against the prefilter yet
+void dispatch_filtered_record(avro_value_t *value, scan_t *scan) {
+    if (scan->filter && !filter_record(scan->filter, value)) {
+        return;
+    }
+    dispatch_record(value, scan);
+}
+
+static bool is_aggregate(query_t *query) {
+    return query->callback == (record_func)lua_script_wrapper &&
+        query->lua_cb_data.type == LUA_CB_TYPE_AGGREGATE;
+}
+
+// merge the cached state of the file, keeps the key to store it otherwise
+static bool fetch_state(query_t *query, const char *path) {
+    query->key = cache_key(query->cache, path);
+    if (!query->key) {
+        return false;
+    }
+
+    char *buf = NULL;
+    size_t buf_len = 0;
+    FILE *fp = open_memstream(&buf, &buf_len);
+    bool hit = cache_fetch(query->cache, query->key, fp);
+    fclose(fp);
+    hit = hit && lua_aggregate_load(&query->lua_cb_data, buf, buf_len);
+    free(buf);
+
+    if (hit) {
+        lua_aggregate_merge(&query->lua_cb_data);
+    }
+    return hit;
+}
+
+// store the file's state if cached, then merge it
+static void end_state(query_t *query, bool ok) {
+    lua_aggregate_end(&query->lua_cb_data);
+    FILE *fp = query->key ? cache_open(query->cache, query->key) : NULL;
+    if (fp) {
+        bool stored = lua_aggregate_store(&query->lua_cb_data, fp);
+        if (!stored) {
+            fprintf(stderr, "Lua state isn't plain data, not cached.\n");
+        }
+        cache_commit(query->cache, query->key, fp, NULL, ok && stored);
+    }
+    lua_aggregate_merge(&query->lua_cb_data);
+}
+
+// replay cached queries, returns true if any query still needs the file.
+// path is NULL for stdin.
+bool scan_begin_file(scan_t *scan, const char *path) {
+    bool pending = false;
+    for (int i = 0; i < scan->query_count; i++) {
+        query_t *query = &scan->queries[i];
+        query->active = true;
+        if (is_aggregate(query)) {
+            if (query->cache && path && fetch_state(query, path)) {
+                query->active = false;
+                free(query->key);
+                query->key = NULL;
+                continue;
+            }
+            lua_aggregate_begin(&query->lua_cb_data);
+        } else if (query->cache && path) {
+            query->key = cache_key(query->cache, path);
+            if (query->key && cache_fetch(query->cache, query->key, query->out)) {
+                query->active = false;
+                free(query->key);
+                query->key = NULL;
+                continue;
+            }
+            if (query->key) {
+                query->capture = cache_open(query->cache, query->key);
+            }
+        }
+        pending = true;
+    }
+    return pending;
+}
+
+// emit captured output, stored only if the whole file was read
+void scan_end_file(scan_t *scan, bool ok) {
+    // _mt jobs write to the capture, wait for them first
+    for (int i = 0; i < scan->query_count; i++) {
+        if (scan->queries[i].capture) {
+            uv_run(loop, UV_RUN_DEFAULT);
+            break;
+        }
+    }
+    for (int i = 0; i < scan->query_count; i++) {
+        query_t *query = &scan->queries[i];
+        if (query->active && is_aggregate(query)) {
+            end_state(query, ok);
+        }
+        if (query->capture) {
+            cache_commit(query->cache, query->key, query->capture, query->out, ok);
+            query->capture = NULL;
+        }
+        free(query->key);
+        query->key = NULL;
+        query->active = true;
+    }
+}
+
+// final output of aggregate queries
+void scan_finish(scan_t *scan) {
+    for (int i = 0; i < scan->query_count; i++) {
+        query_t *query = &scan->queries[i];
+        if (is_aggregate(query)) {
+            output = query->out;
+            lua_aggregate_finish(&query->lua_cb_data);
+        }
+    }
+    output = stdout;
+}
+
+// wait for queued jobs and flush every query output
+void sync_scan(scan_t *scan) {
+    uv_run(loop, UV_RUN_DEFAULT);
+    fflush(stdout);
+    for (int i = 0; i < scan->query_count; i++) {
+        fflush(scan->queries[i].out);
+    }
+}
+
+typedef struct read_file_callback {
+    char *input;
+    scan_t *scan;
+    bool follow;
+    char *state;
 } read_file_callback_t;
 
-void read_file_with_callback(char *input, record_func callback, void *user_data) {
+void read_file_with_callback(char *input, scan_t *scan) {
+    if (strcmp(input, "-") == 0) {
+        printf("--- [0] <stdin> ---\n");
+        scan_begin_file(scan, NULL);
+        int rval = read_avro_stream(STDIN_FILENO, (record_func)dispatch_record, scan, scan->filter, scan->join, NULL);
+        if (rval == STREAM_UNSUPPORTED_CODEC) {
+            fprintf(stderr, "Unsupported codec in <stdin>.\n");
+        }
+        scan_end_file(scan, rval == 0);
+        return;
+    }
+
     glob_t glob_results;
     glob(input, GLOB_TILDE, NULL, &glob_results);
 
     for (int i = 0; i < glob_results.gl_pathc; ++i) {
         char *path = glob_results.gl_pathv[i];
         printf("--- [%d] %s ---\n", i, path);
-        /* read_avro_file_custom(path, callback, user_data); */
-        read_avro_file_default(path, callback, user_data);
+
+        // block reader handles regular files and pipes alike
+        int fd = open(path, O_RDONLY);
+        if (fd == -1) {
+            fprintf(stderr, "Can't open %s.\n", path);
+            continue;
+        }
+
+        int rval = 0;
+        if (scan_begin_file(scan, path)) {
+            rval = read_avro_stream(fd, (record_func)dispatch_record, scan, scan->filter, scan->join, NULL);
+        }
+        if (rval == STREAM_UNSUPPORTED_CODEC) {
+            // other codecs go through avro's own file reader, which
+            // needs to reopen a regular file and can't join
+            struct stat st;
+            if (scan->join || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+                fprintf(stderr, "Unsupported codec in %s.\n", path);
+                rval = -1;
+            } else {
+                rval = read_avro_file_default(path, (record_func)dispatch_filtered_record, scan);
+            }
+        }
+        close(fd);
+        scan_end_file(scan, rval == 0);
     }
+
+    globfree(&glob_results);
 }
 
 void read_file_with_callback_wrapper(read_file_callback_t *cb_data) {
-    read_file_with_callback(cb_data->input, cb_data->callback, cb_data->user_data);
+    output = stdout;
+    if (cb_data->follow) {
+        follow_files(cb_data->input, cb_data->state, (record_func)dispatch_record, (follow_sync_func)sync_scan,
+                     cb_data->scan, cb_data->scan->filter, cb_data->scan->join);
+        return;
+    }
+    read_file_with_callback(cb_data->input, cb_data->scan);
+    // outputs are closed by main, so finish their jobs first
+    uv_run(loop, UV_RUN_DEFAULT);
+    scan_finish(cb_data->scan);
+}
+
+// query identity: handler, its param (script text for lua_script), filter
+// and joined lookup file
+cache_t* new_query_cache(const char *dir, query_options_t *opts, const char *join) {
+    char *query = NULL;
+    size_t query_len = 0;
+    FILE *fp = open_memstream(&query, &query_len);
+    fprintf(fp, "%s%c%s%c%s%c", opts->handler, 0,
+            opts->param ? opts->param : "", 0,
+            opts->contains ? opts->contains : "", 0);
+    if (strcmp(opts->handler, "lua_script") == 0) {
+        FILE *script = fopen(opts->param, "rb");
+        char buf[4096];
+        size_t n;
+        while (script && (n = fread(buf, 1, sizeof(buf), script)) > 0) {
+            fwrite(buf, 1, n, fp);
+        }
+        if (script) {
+            fclose(script);
+        }
+    }
+    if (join) {
+        struct stat st;
+        const char *eq = strchr(join, '=');
+        fprintf(fp, "%s%c", join, 0);
+        if (eq && stat(eq + 1, &st) == 0) {
+            fprintf(fp, "%llu\t%lld\t%lld", (unsigned long long)st.st_ino,
+                    (long long)st.st_size, (long long)st.st_mtime);
+        }
+    }
+    fclose(fp);
+
+    cache_t *cache = cache_new(dir, query, query_len);
+    free(query);
+    return cache;
+}
+
+// follow: outputs are appended to, so resumed runs keep earlier output
+int init_query(query_t *query, query_options_t *opts, bool follow, const char *cache_dir, const char *join) {
+    memset(query, 0, sizeof(query_t));
+    query->active = true;
+
+    if (!opts->handler) {
+        fprintf(stderr, "Invalid handler.\n");
+        return 1;
+    }
+
+    if (strcmp(opts->handler, "cat") == 0) {
+        query->callback = (record_func)dump_avro_value_mt;
+    } else if (strcmp(opts->handler, "grep") == 0) {
+        // cat records with a string containing one of the patterns
+        query->callback = (record_func)dump_avro_value_mt;
+        query->filter = opts->param ? filter_new(opts->param) : NULL;
+        if (!query->filter) {
+            fprintf(stderr, "Invalid grep pattern.\n");
+            return 1;
+        }
+        if (opts->contains) {
+            fprintf(stderr, "Can't combine grep with --contains, list all patterns in -p.\n");
+            return 1;
+        }
+    } else if (strcmp(opts->handler, "field_print") == 0) {
+        query->callback = (record_func)field_printer_mt;
+        query->user_data = opts->param;
+    } else if (strcmp(opts->handler, "lua_inline") == 0) {
+        init_lua_cb_inline(&query->lua_cb_data, opts->param);
+        query->callback = (record_func)lua_script_wrapper;
+        query->user_data = &query->lua_cb_data;
+    } else if (strcmp(opts->handler, "lua_script") == 0) {
+        if (!opts->param || access(opts->param, F_OK) == -1) {
+            puts("invalid lua script file.");
+            return 1;
+        }
+        query->callback = (record_func)lua_script_wrapper;
+        query->user_data = &query->lua_cb_data;
+        if (init_lua_cb_script(&query->lua_cb_data, opts->param) != 0) {
+            fprintf(stderr, "Invalid lua aggregate script, init, record and merge are required.\n");
+            return 1;
+        }
+        // states are merged per file, followed files never end
+        if (follow && query->lua_cb_data.type == LUA_CB_TYPE_AGGREGATE) {
+            fprintf(stderr, "Can't follow with a lua aggregate script.\n");
+            return 1;
+        }
+    } else {
+        fprintf(stderr, "Invalid handler.\n");
+        return 1;
+    }
+
+    if (opts->contains && !query->filter) {
+        query->filter = filter_new(opts->contains);
+        if (!query->filter) {
+            fprintf(stderr, "Invalid --contains pattern.\n");
+            return 1;
+        }
+    }
+
+    query->out = stdout;
+    if (opts->output) {
+        query->out = fopen(opts->output, follow ? "a" : "w");
+        if (!query->out) {
+            fprintf(stderr, "Can't open output %s.\n", opts->output);
+            query->out = stdout;
+            return 1;
+        }
+    }
+
+    // plain lua handlers may keep state across files, so their output for
+    // one file can't be replayed on its own; aggregates cache their states
+    if (cache_dir) {
+        if (query->callback == (record_func)lua_script_wrapper && !is_aggregate(query)) {
+            fprintf(stderr, "Cache is only used for lua aggregate scripts.\n");
+        } else {
+            query->cache = new_query_cache(cache_dir, opts, join);
+        }
+    }
+
+    return 0;
+}
+
+void free_query(query_t *query) {
+    if (query->callback == (record_func)lua_script_wrapper) {
+        free_lua_cb(&query->lua_cb_data);
+    }
+    if (query->filter) {
+        filter_free(query->filter);
+    }
+    if (query->cache) {
+        cache_free(query->cache);
+    }
+    if (query->out && query->out != stdout) {
+        fclose(query->out);
+    }
+}
+
+// blocks can only be skipped if every query filters its records
+filter_t* new_scan_filter(scan_t *scan) {
+    for (int i = 0; i < scan->query_count; i++) {
+        if (!scan->queries[i].filter) {
+            return NULL;
+        }
+    }
+    if (scan->query_count == 1) {
+        return scan->queries[0].filter;
+    }
+
+    char *patterns = NULL;
+    size_t patterns_len = 0;
+    FILE *fp = open_memstream(&patterns, &patterns_len);
+    for (int i = 0; i < scan->query_count; i++) {
+        filter_t *filter = scan->queries[i].filter;
+        for (size_t j = 0; j < filter->count; j++) {
+            fprintf(fp, "%s,", filter->patterns[j]);
+        }
+    }
+    fclose(fp);
+
+    filter_t *filter = filter_new(patterns);
+    free(patterns);
+    return filter;
 }
 
 int main(int argc, char **argv) {
+    // must precede any avro allocation
+    arena_install();
+
     loop = uv_default_loop();
 
     options_t *options = new_options();
@@ -220,54 +763,76 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    if (!options->handler) {
+    if (options->follow && strcmp(options->input, "-") == 0) {
+        fprintf(stderr, "Can't follow stdin.\n");
+        free_options(options);
+        return 1;
+    }
+
+    if (options->query_count == 0) {
         fprintf(stderr, "Invalid handler.\n");
         free_options(options);
         return 1;
     }
 
-    read_file_callback_t cb_data;
-
-    if (strcmp(options->handler, "cat") == 0) {
-        cb_data = (read_file_callback_t) {
-            .input = options->input,
-            .callback = (record_func)dump_avro_value_mt,
-            .user_data = NULL
-        };
-    } else if (strcmp(options->handler, "field_print") == 0) {
-        cb_data = (read_file_callback_t) {
-            .input = options->input,
-            .callback = (record_func)field_printer_mt,
-            .user_data = options->param
-        };
-    } else {
-        lua_cb_user_data_t lua_cb_data;
-        if (strcmp(options->handler, "lua_inline") == 0) {
-            init_lua_cb_inline(&lua_cb_data, options->param);
-        } else if (strcmp(options->handler, "lua_script") == 0) {
-            if (access(options->param, F_OK) == -1) {
-                puts("invalid lua script file.");
-                uv_loop_close(loop);
-                free(loop);
-                free_options(options);
-                return 1;
+    scan_t scan;
+    scan.query_count = 0;
+    for (int i = 0; i < options->query_count; i++) {
+        // followed files never stay unchanged, there is nothing to cache
+        int rval = init_query(&scan.queries[i], &options->queries[i], options->follow,
+                              options->follow ? NULL : options->cache, options->join);
+        if (rval != 0) {
+            free_query(&scan.queries[i]);
+            for (int j = 0; j < scan.query_count; j++) {
+                free_query(&scan.queries[j]);
+            }
+            free_options(options);
+            return 1;
+        }
+        scan.query_count++;
+    }
+    scan.filter = new_scan_filter(&scan);
+
+    scan.join = NULL;
+    if (options->join) {
+        scan.join = join_new(options->join);
+        if (!scan.join || (options->join_save && join_save(scan.join, options->join_save) != 0)) {
+            if (scan.join) {
+                join_free(scan.join);
+            }
+            if (scan.filter && scan.filter != scan.queries[0].filter) {
+                filter_free(scan.filter);
             }
-            init_lua_cb_script(&lua_cb_data, options->param);
+            for (int i = 0; i < scan.query_count; i++) {
+                free_query(&scan.queries[i]);
+            }
+            free_options(options);
+            return 1;
         }
-        cb_data = (read_file_callback_t) {
-            .input = options->input,
-            .callback = (record_func)lua_script_wrapper,
-            .user_data = &lua_cb_data
-        };
     }
 
-    // start event loop
-    uv_run(loop, UV_RUN_DEFAULT);
+    read_file_callback_t cb_data = {
+        .input = options->input,
+        .scan = &scan,
+        .follow = options->follow,
+        .state = options->state
+    };
 
+    // reader runs the loop itself and returns once its jobs are done
     uv_thread_t reader;
     uv_thread_create(&reader, (uv_thread_cb)read_file_with_callback_wrapper, &cb_data);
     uv_thread_join(&reader);
 
+    if (scan.filter && scan.filter != scan.queries[0].filter) {
+        filter_free(scan.filter);
+    }
+    for (int i = 0; i < scan.query_count; i++) {
+        free_query(&scan.queries[i]);
+    }
+    // queued records point into the table, all of them are done by now
+    if (scan.join) {
+        join_free(scan.join);
+    }
     free_options(options);
     return 0;
 }
@@ -1,31 +1,67 @@
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
 #include <getopt.h>
+#include <string.h>
+
+#define MAX_QUERIES 16
+
+// one handler attached to the scan
+typedef struct query_options {
+    char *handler, *param, *contains, *output;
+} query_options_t;
 
 typedef struct options {
-    char *input, *handler, *param;
-    int count, thread_count;
+    char *input, *state, *cache, *join, *join_save;
+    int count, thread_count, follow, query_count;
+    query_options_t queries[MAX_QUERIES];
 } options_t;
 
 options_t* new_options() {
     options_t *opts = malloc(sizeof(options_t));
     opts->input = NULL;
-    opts->handler = NULL;
-    opts->param = NULL;
+    opts->state = NULL;
+    opts->cache = NULL;
+    opts->join = NULL;
+    opts->join_save = NULL;
     opts->count = INT_MAX;
     opts->thread_count = 1;
+    opts->follow = 0;
+    opts->query_count = 0;
+    memset(opts->queries, 0, sizeof(opts->queries));
     return opts;
 }
 
 void free_options(options_t *opts) {
     free(opts->input);
-    free(opts->handler);
-    free(opts->param);
+    free(opts->state);
+    free(opts->cache);
+    free(opts->join);
+    free(opts->join_save);
+    for (int i = 0; i < opts->query_count; i++) {
+        free(opts->queries[i].handler);
+        free(opts->queries[i].param);
+        free(opts->queries[i].contains);
+        free(opts->queries[i].output);
+    }
+}
+
+// query the next -p/-s/-o applies to; every -c after the first starts a new one
+query_options_t* current_query(options_t *opts, bool new_handler) {
+    if (opts->query_count == 0 ||
+        (new_handler && opts->queries[opts->query_count - 1].handler)) {
+        if (opts->query_count == MAX_QUERIES) {
+            return NULL;
+        }
+        opts->query_count++;
+    }
+    return &opts->queries[opts->query_count - 1];
 }
 
 int parse_opts(int argc, char **argv, options_t *opts) {
     int c = 0;
+    query_options_t *query = NULL;
     while (1) {
         static struct option long_options[] = {
             {"input", required_argument, 0, 'i'},
@@ -33,34 +69,79 @@ int parse_opts(int argc, char **argv, options_t *opts) {
             {"param", required_argument, 0, 'p'},
             {"count", required_argument, 0, 'n'},
             {"threads", required_argument, 0, 'j'},
+            {"contains", required_argument, 0, 's'},
+            {"follow", no_argument, 0, 'f'},
+            {"state", required_argument, 0, 'S'},
+            {"cache", required_argument, 0, 'C'},
+            {"output", required_argument, 0, 'o'},
+            {"join", required_argument, 0, 'J'},
+            {"join-save", required_argument, 0, 'W'},
             {0, 0, 0, 0}
         };
 
         int opt_index = 0;
-        c = getopt_long(argc, argv, "i:c:p:n:", long_options, &opt_index);
+        c = getopt_long(argc, argv, "i:c:p:n:s:fS:C:o:J:W:", long_options, &opt_index);
 
         if (c == -1)
             break;
 
+        if (c == 'c' || c == 'p' || c == 's' || c == 'o') {
+            query = current_query(opts, c == 'c');
+            if (!query) {
+                fprintf(stderr, "Too many queries.\n");
+                return 1;
+            }
+        }
+
         switch (c) {
         case 'i':
             opts->input = strdup(optarg);
             break;
         case 'c':
-            opts->handler = strdup(optarg);
+            query->handler = strdup(optarg);
             break;
         case 'p':
-            opts->param = strdup(optarg);
+            free(query->param);
+            query->param = strdup(optarg);
             break;
         case 'n':
             opts->count = atoi(optarg);
             break;
+        case 's':
+            free(query->contains);
+            query->contains = strdup(optarg);
+            break;
+        case 'o':
+            free(query->output);
+            query->output = strdup(optarg);
+            break;
+        case 'f':
+            opts->follow = 1;
+            break;
+        case 'S':
+            opts->state = strdup(optarg);
+            break;
+        case 'C':
+            opts->cache = strdup(optarg);
+            break;
+        case 'J':
+            opts->join = strdup(optarg);
+            break;
+        case 'W':
+            opts->join_save = strdup(optarg);
+            break;
         default:
             printf(
                 "usage: %s\
-\n\t-i AVRO_FILE\
-\n\t-c [lua_inline|lua_script|field_print|cat]\
+\n\t-i AVRO_FILE|-\
+\n\t-c [lua_inline|lua_script|field_print|cat|grep]\
 \n\t[-p HANDLER_PARAM]\
+\n\t[-s|--contains PATTERN[,PATTERN...]]\
+\n\t[-o|--output OUTPUT_FILE]\
+\n\t[-c ... (more handlers sharing one scan)]\
+\n\t[-f|--follow [-S|--state STATE_FILE]]\
+\n\t[-C|--cache CACHE_DIR]\
+\n\t[-J|--join KEY_PATH=LOOKUP_FILE [-W|--join-save TABLE_FILE]]\
 \n\t[-n RECORDS_COUNT]\n", argv[0]);
 
             return 1;
@@ -0,0 +1,404 @@
+#include <errno.h>
+
+#include "arena.h"
+#include "decode.h"
+#include "stream.h"
+
+// fd reader
+int fd_read(fd_reader_t *reader, void *dst, size_t len) {
+    char *out = (char *)dst;
+    while (len > 0) {
+        if (reader->pos == reader->len) {
+            if (reader->eof) {
+                return -1;
+            }
+            ssize_t n = read(reader->fd, reader->buf, STREAM_BUF_SIZE);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                reader->eof = true;
+                return -1;
+            }
+            reader->pos = 0;
+            reader->len = n;
+        }
+        size_t chunk = reader->len - reader->pos;
+        if (chunk > len) {
+            chunk = len;
+        }
+        memcpy(out, reader->buf + reader->pos, chunk);
+        reader->pos += chunk;
+        reader->offset += chunk;
+        out += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+int fd_read_varint(fd_reader_t *reader, int64_t *res) {
+    uint64_t value = 0;
+    uint8_t b;
+    int offset = 0;
+    do {
+        if (offset == 10 || fd_read(reader, &b, 1) != 0) {
+            return -1;
+        }
+        value |= (uint64_t) (b & 0x7F) << (7 * offset);
+        ++offset;
+    }
+    while (b & 0x80);
+    *res = ((value >> 1) ^ -(value & 1));
+    return 0;
+}
+
+static int fd_read_bytes(fd_reader_t *reader, char **dst, int64_t *len) {
+    if (fd_read_varint(reader, len) != 0 || *len < 0 || *len > STREAM_MAX_META_SIZE) {
+        return -1;
+    }
+    *dst = malloc(*len + 1);
+    if (!*dst) {
+        return -1;
+    }
+    if (fd_read(reader, *dst, *len) != 0) {
+        free(*dst);
+        return -1;
+    }
+    (*dst)[*len] = 0;
+    return 0;
+}
+
+// header: magic, meta map, sync marker
+int read_avro_header(fd_reader_t *reader, avro_header_t *header) {
+    char magic[4];
+    if (fd_read(reader, magic, sizeof(magic)) != 0 ||
+        magic[0] != 'O' || magic[1] != 'b' || magic[2] != 'j' || magic[3] != 1) {
+        fprintf(stderr, "Invalid magic.\n");
+        return -1;
+    }
+
+    memset(header, 0, sizeof(avro_header_t));
+    strcpy(header->codec, "null");
+
+    int64_t count = 0;
+    while (1) {
+        if (fd_read_varint(reader, &count) != 0) {
+            goto error;
+        }
+        if (count == 0) {
+            break;
+        }
+        if (count < 0) {
+            int64_t block_size = 0;
+            count = -count;
+            if (fd_read_varint(reader, &block_size) != 0) {
+                goto error;
+            }
+        }
+        for (int64_t i = 0; i < count; i++) {
+            char *key = NULL, *val = NULL;
+            int64_t key_len = 0, val_len = 0;
+            if (fd_read_bytes(reader, &key, &key_len) != 0) {
+                goto error;
+            }
+            if (fd_read_bytes(reader, &val, &val_len) != 0) {
+                free(key);
+                goto error;
+            }
+            if (strcmp(key, "avro.codec") == 0) {
+                strncpy(header->codec, val, val_len < 10 ? val_len : 10);
+                header->codec[val_len < 10 ? val_len : 10] = 0;
+                free(val);
+            } else if (strcmp(key, "avro.schema") == 0) {
+                free(header->schema_json);
+                header->schema_json = val;
+                header->schema_len = val_len;
+            } else {
+                free(val);
+            }
+            free(key);
+        }
+    }
+
+    if (!header->schema_json || fd_read(reader, header->sync, sizeof(header->sync)) != 0) {
+        goto error;
+    }
+
+    return 0;
+
+error:
+    fprintf(stderr, "Invalid avro header.\n");
+    free(header->schema_json);
+    header->schema_json = NULL;
+    return -1;
+}
+
+// block ring
+static void block_ring_init(block_ring_t *ring, uint16_t size) {
+    ring->head = 0;
+    ring->len = 0;
+    ring->size = size;
+    ring->done = false;
+    ring->blocks = calloc(size, sizeof(block_t));
+    uv_cond_init(&ring->full);
+    uv_cond_init(&ring->empty);
+    uv_mutex_init(&ring->mutex);
+}
+
+static void block_ring_destroy(block_ring_t *ring) {
+    for (int i = 0; i < ring->size; i++) {
+        free(ring->blocks[i].data);
+    }
+    free(ring->blocks);
+    uv_cond_destroy(&ring->full);
+    uv_cond_destroy(&ring->empty);
+    uv_mutex_destroy(&ring->mutex);
+}
+
+// next free slot for the block reader, NULL if decoder stopped
+static block_t* block_ring_reserve(block_ring_t *ring) {
+    uv_mutex_lock(&ring->mutex);
+    while (ring->len == ring->size && !ring->done) {
+        uv_cond_wait(&ring->full, &ring->mutex);
+    }
+    block_t *block = ring->done ? NULL : &ring->blocks[(ring->head + ring->len) % ring->size];
+    uv_mutex_unlock(&ring->mutex);
+    return block;
+}
+
+static void block_ring_commit(block_ring_t *ring) {
+    uv_mutex_lock(&ring->mutex);
+    ring->len++;
+    uv_mutex_unlock(&ring->mutex);
+    uv_cond_signal(&ring->empty);
+}
+
+// oldest filled slot for the decoder, NULL once reader is done
+static block_t* block_ring_peek(block_ring_t *ring) {
+    uv_mutex_lock(&ring->mutex);
+    while (ring->len == 0 && !ring->done) {
+        uv_cond_wait(&ring->empty, &ring->mutex);
+    }
+    block_t *block = ring->len ? &ring->blocks[ring->head] : NULL;
+    uv_mutex_unlock(&ring->mutex);
+    return block;
+}
+
+static void block_ring_release(block_ring_t *ring) {
+    uv_mutex_lock(&ring->mutex);
+    ring->head = (ring->head + 1) % ring->size;
+    ring->len--;
+    uv_mutex_unlock(&ring->mutex);
+    uv_cond_signal(&ring->full);
+}
+
+static void block_ring_finish(block_ring_t *ring) {
+    uv_mutex_lock(&ring->mutex);
+    ring->done = true;
+    uv_mutex_unlock(&ring->mutex);
+    uv_cond_broadcast(&ring->empty);
+    uv_cond_broadcast(&ring->full);
+}
+
+// block reader thread
+typedef struct block_reader_data {
+    fd_reader_t *reader;
+    avro_header_t *header;
+    block_ring_t *ring;
+    // partial trailing block is expected (file still being written)
+    bool partial;
+    // stopped on invalid or truncated input
+    bool failed;
+} block_reader_data_t;
+
+static void read_blocks(block_reader_data_t *data) {
+    char sync[16];
+    while (1) {
+        block_t *block = block_ring_reserve(data->ring);
+        if (!block) {
+            break;
+        }
+
+        int64_t size = 0;
+        if (fd_read_varint(data->reader, &block->count) != 0) {
+            break;
+        }
+        if (fd_read_varint(data->reader, &size) != 0 || size < 0) {
+            if (!data->partial) {
+                fprintf(stderr, "Truncated avro block.\n");
+                data->failed = true;
+            }
+            break;
+        }
+        if (size > STREAM_MAX_BLOCK_SIZE) {
+            fprintf(stderr, "Invalid avro block size.\n");
+            data->failed = true;
+            break;
+        }
+        if (block->cap < size) {
+            char *buf = realloc(block->data, size);
+            if (!buf) {
+                fprintf(stderr, "Can't allocate avro block.\n");
+                data->failed = true;
+                break;
+            }
+            block->data = buf;
+            block->cap = size;
+        }
+        block->size = size;
+        if (fd_read(data->reader, block->data, size) != 0 ||
+            fd_read(data->reader, sync, sizeof(sync)) != 0) {
+            if (!data->partial) {
+                fprintf(stderr, "Truncated avro block.\n");
+                data->failed = true;
+            }
+            break;
+        }
+        if (memcmp(sync, data->header->sync, sizeof(sync)) != 0) {
+            fprintf(stderr, "Invalid sync marker.\n");
+            data->failed = true;
+            break;
+        }
+        block->end = data->reader->offset;
+
+        block_ring_commit(data->ring);
+    }
+    block_ring_finish(data->ring);
+}
+
+// streaming avro reader: blocks are decoded as soon as they are complete.
+// With offset set, reading resumes at *offset (a block boundary) and
+// *offset is advanced past every processed block. Returns -1 if the
+// input was invalid or truncated (records before the error are
+// processed), STREAM_UNSUPPORTED_CODEC, with nothing decoded, if the
+// codec isn't null or deflate.
+int read_avro_stream(int fd, record_func callback, void *user_data, filter_t *filter, join_t *join, off_t *offset) {
+    fd_reader_t reader = {.fd = fd, .eof = false, .offset = 0, .pos = 0, .len = 0};
+    reader.buf = malloc(STREAM_BUF_SIZE);
+
+    avro_header_t header;
+    if (read_avro_header(&reader, &header) != 0) {
+        free(reader.buf);
+        return -1;
+    }
+
+    bool deflate = strcmp(header.codec, "deflate") == 0;
+    if (!deflate && strcmp(header.codec, "null") != 0) {
+        free(header.schema_json);
+        free(reader.buf);
+        return STREAM_UNSUPPORTED_CODEC;
+    }
+
+    program_t *program = program_get(header.schema_json, header.schema_len);
+    if (!program) {
+        free(header.schema_json);
+        free(reader.buf);
+        return -1;
+    }
+
+    avro_value_iface_t *iface = program->iface;
+    if (join) {
+        iface = join_class(join, program);
+        if (!iface) {
+            free(header.schema_json);
+            free(reader.buf);
+            return -1;
+        }
+    }
+
+    if (offset) {
+        if (*offset > reader.offset && lseek(fd, *offset, SEEK_SET) == *offset) {
+            reader.offset = *offset;
+            reader.pos = 0;
+            reader.len = 0;
+        }
+        *offset = reader.offset;
+    }
+
+    block_ring_t ring;
+    block_ring_init(&ring, BLOCK_RING_SIZE);
+
+    block_reader_data_t reader_data = {.reader = &reader, .header = &header, .ring = &ring,
+                                       .partial = offset != NULL, .failed = false};
+    uv_thread_t reader_thread;
+    uv_thread_create(&reader_thread, (uv_thread_cb)read_blocks, &reader_data);
+
+    int rval = 0;
+    block_t *block;
+    while ((block = block_ring_peek(&ring))) {
+        // records of the block share one arena, which also
+        // owns the decoded block their strings and bytes point into
+        arena_t *arena = arena_get();
+        size_t size = block->size;
+        if (deflate) {
+            if (arena->block_cap < block->size * 2) {
+                arena->block_cap = block->size * 4;
+                arena->block = realloc(arena->block, arena->block_cap);
+            }
+            if (inflate_block(block->data, block->size, &arena->block, &arena->block_cap, &size) != 0) {
+                fprintf(stderr, "Invalid deflate block.\n");
+                rval = -1;
+                arena_unref(arena);
+                block_ring_finish(&ring);
+                break;
+            }
+        } else {
+            // swap buffers instead of copying the raw block
+            char *data = block->data;
+            size_t cap = block->cap;
+            block->data = arena->block;
+            block->cap = arena->block_cap;
+            arena->block = data;
+            arena->block_cap = cap;
+        }
+
+        if (filter && !filter_block(filter, arena->block, size)) {
+            arena_unref(arena);
+            if (offset) {
+                *offset = block->end;
+            }
+            block_ring_release(&ring);
+            continue;
+        }
+
+        arena_enter(arena);
+
+        cursor_t cursor = {.pos = arena->block, .end = arena->block + size};
+        for (int64_t i = 0; i < block->count; i++) {
+            avro_value_t value;
+            avro_generic_value_new(iface, &value);
+            if (program_decode(program, &cursor, &value) != 0) {
+                fprintf(stderr, "Invalid avro record.\n");
+                rval = -1;
+                avro_value_decref(&value);
+                break;
+            }
+            if (join) {
+                join_reset(program, &value);
+            }
+            if (!filter || filter_record(filter, &value)) {
+                if (join) {
+                    join_record(join, program, &value);
+                }
+                callback(&value, user_data);
+            }
+            avro_value_decref(&value);
+        }
+
+        arena_leave(arena);
+        if (offset) {
+            *offset = block->end;
+        }
+        block_ring_release(&ring);
+    }
+
+    uv_thread_join(&reader_thread);
+    block_ring_destroy(&ring);
+    if (reader_data.failed) {
+        rval = -1;
+    }
+
+    free(header.schema_json);
+    free(reader.buf);
+    return rval;
+}
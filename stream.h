@@ -0,0 +1,64 @@
+#ifndef LAQ_STREAM_H
+#define LAQ_STREAM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <uv.h>
+
+#include "filter.h"
+#include "join.h"
+#include "utils.h"
+
+#define STREAM_BUF_SIZE 64 * 1024
+#define BLOCK_RING_SIZE 4
+// sanity limits for lengths read from the input
+#define STREAM_MAX_META_SIZE 64 * 1024 * 1024
+#define STREAM_MAX_BLOCK_SIZE 512 * 1024 * 1024
+
+// read_avro_stream result for codecs other than null and deflate
+#define STREAM_UNSUPPORTED_CODEC 1
+
+// buffered reader over a plain fd (stdin, pipe, fifo)
+typedef struct fd_reader {
+    int fd;
+    bool eof;
+    // offset of the next unread byte
+    off_t offset;
+    size_t pos, len;
+    char *buf;
+} fd_reader_t;
+
+// avro container header
+typedef struct avro_header {
+    char codec[11];
+    char sync[16];
+    char *schema_json;
+    size_t schema_len;
+} avro_header_t;
+
+// raw (still compressed) avro block
+typedef struct block {
+    int64_t count;
+    // offset right after the block's sync marker
+    off_t end;
+    size_t size, cap;
+    char *data;
+} block_t;
+
+// ring of block buffers shared by block reader and decoder
+typedef struct block_ring {
+    uint16_t head, len, size;
+    bool done;
+    uv_cond_t empty, full;
+    uv_mutex_t mutex;
+    block_t *blocks;
+} block_ring_t;
+
+int fd_read(fd_reader_t *reader, void *dst, size_t len);
+int fd_read_varint(fd_reader_t *reader, int64_t *res);
+int read_avro_header(fd_reader_t *reader, avro_header_t *header);
+int read_avro_stream(int fd, record_func callback, void *user_data, filter_t *filter, join_t *join, off_t *offset);
+
+#endif
@@ -1,5 +1,10 @@
+#include <math.h>
+
 #include "utils.h"
 
+// handler output of the current thread
+__thread FILE *output = NULL;
+
 int inflate_buf(const char *src, char *dst, size_t len, size_t *out_len) {
     int ret = 0;
     z_stream stream;
@@ -21,6 +26,52 @@ int inflate_buf(const char *src, char *dst, size_t len, size_t *out_len) {
     return ret;
 }
 
+// FNV-1a, chain calls by passing the previous hash as seed
+uint64_t hash_bytes(const void *buf, size_t len, uint64_t seed) {
+    const uint8_t *p = (const uint8_t *)buf;
+    uint64_t hash = seed ? seed : 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// inflate into growable buffer
+int inflate_block(const char *src, size_t len, char **dst, size_t *cap, size_t *out_len) {
+    int ret = 0;
+    z_stream stream;
+
+    stream.zalloc = (voidpf)0;
+    stream.zfree = (voidpf)0;
+    stream.opaque = (voidpf)0;
+    stream.next_in = (Bytef *)src;
+    stream.avail_in = (uInt)len;
+    inflateInit2(&stream, -15);
+
+    stream.next_out = (Bytef *)*dst;
+    stream.avail_out = (uInt)*cap;
+    while (1) {
+        ret = inflate(&stream, Z_FINISH);
+        if (ret == Z_STREAM_END) {
+            break;
+        }
+        if ((ret != Z_OK && ret != Z_BUF_ERROR) || stream.avail_out != 0) {
+            inflateEnd(&stream);
+            return -1;
+        }
+        *cap = *cap ? *cap * 2 : CHUNK;
+        *dst = realloc(*dst, *cap);
+        stream.next_out = (Bytef *)*dst + stream.total_out;
+        stream.avail_out = (uInt)(*cap - stream.total_out);
+    }
+    inflateEnd(&stream);
+
+    *out_len = stream.total_out;
+
+    return 0;
+}
+
 // avro varint reader
 void read_varint(avro_reader_t reader, int64_t *res)
 {
@@ -100,7 +151,8 @@ void push_avro_value(lua_State *L, avro_value_t *value) {
         const char *val = NULL;
         size_t size = 0;
         avro_value_get_string(value, &val, &size);
-        lua_pushstring(L, val);
+        // size includes the terminating NUL
+        lua_pushlstring(L, val, size ? size - 1 : 0);
         break;
     }
 
@@ -147,10 +199,86 @@ void push_avro_value(lua_State *L, avro_value_t *value) {
     }
 }
 
+// plain lua data (nil, booleans, numbers, strings and tables of them) as
+// a lua expression, -1 for anything else
+int serialize_lua_value(lua_State *L, int idx, FILE *fp, int depth) {
+    if (idx < 0) {
+        idx = lua_gettop(L) + idx + 1;
+    }
+
+    switch (lua_type(L, idx)) {
+    case LUA_TNIL:
+        fputs("nil", fp);
+        return 0;
+
+    case LUA_TBOOLEAN:
+        fputs(lua_toboolean(L, idx) ? "true" : "false", fp);
+        return 0;
+
+    case LUA_TNUMBER:
+    {
+        double val = lua_tonumber(L, idx);
+        if (isnan(val)) {
+            fputs("0/0", fp);
+        } else if (isinf(val)) {
+            fputs(val > 0 ? "1/0" : "-1/0", fp);
+        } else {
+            fprintf(fp, "%.17g", val);
+        }
+        return 0;
+    }
+
+    case LUA_TSTRING:
+    {
+        size_t len = 0;
+        const char *val = lua_tolstring(L, idx, &len);
+        fputc('"', fp);
+        for (size_t i = 0; i < len; i++) {
+            unsigned char c = val[i];
+            if (c == '"' || c == '\\') {
+                fprintf(fp, "\\%c", c);
+            } else if (c < 32 || c > 126) {
+                fprintf(fp, "\\%03d", c);
+            } else {
+                fputc(c, fp);
+            }
+        }
+        fputc('"', fp);
+        return 0;
+    }
+
+    case LUA_TTABLE:
+        if (depth == LUA_SERIALIZE_DEPTH) {
+            return -1;
+        }
+        fputc('{', fp);
+        lua_pushnil(L);
+        while (lua_next(L, idx)) {
+            fputc('[', fp);
+            if (serialize_lua_value(L, -2, fp, depth + 1) != 0) {
+                lua_pop(L, 2);
+                return -1;
+            }
+            fputs("]=", fp);
+            if (serialize_lua_value(L, -1, fp, depth + 1) != 0) {
+                lua_pop(L, 2);
+                return -1;
+            }
+            fputc(',', fp);
+            lua_pop(L, 1);
+        }
+        fputc('}', fp);
+        return 0;
+
+    default:
+        return -1;
+    }
+}
+
 // field printer
 void print_indent(int indent) {
     for (int i = 0; i < indent; i++) {
-        printf(" ");
+        fprintf(output, " ");
     }
 }
 
@@ -160,7 +288,7 @@ void print_avro_value(avro_value_t *value, int indent) {
     {
         int val = 0;
         avro_value_get_boolean(value, &val);
-        printf(val ? "true" : "false");
+        fputs(val ? "true" : "false", output);
         break;
     }
 
@@ -171,13 +299,13 @@ void print_avro_value(avro_value_t *value, int indent) {
     {
         double val = 0;
         avro_value_get_double(value, &val);
-        printf("%g", val);
+        fprintf(output, "%g", val);
         break;
     }
 
     case AVRO_NULL:
     {
-        printf("<null>");
+        fprintf(output, "<null>");
         break;
     }
 
@@ -186,7 +314,7 @@ void print_avro_value(avro_value_t *value, int indent) {
         const void *val = NULL;
         size_t size = 0;
         avro_value_get_bytes(value, &val, &size);
-        printf("%s", val);
+        fwrite(val, 1, size, output);
         break;
     }
 
@@ -195,14 +323,14 @@ void print_avro_value(avro_value_t *value, int indent) {
         const char *val = NULL;
         size_t size = 0;
         avro_value_get_string(value, &val, &size);
-        printf("%s", val);
+        fprintf(output, "%s", val);
         break;
     }
 
     case AVRO_ENUM:
     case AVRO_FIXED:
     {
-        printf("unsupported type");
+        fprintf(output, "unsupported type");
         break;
     }
 
@@ -213,22 +341,22 @@ void print_avro_value(avro_value_t *value, int indent) {
         size_t field_count = 0;
         avro_value_get_size(value, &field_count);
 
-        printf("{\n");
+        fprintf(output, "{\n");
         for (int i = 0; i < field_count; i++) {
             const char *field_name = NULL;
             avro_value_t field;
             avro_value_get_by_index(value, i, &field, &field_name);
             print_indent(indent + 1);
             if (!field_name) {
-                printf("%d: ", i);
+                fprintf(output, "%d: ", i);
             } else {
-                printf("%s: ", field_name);
+                fprintf(output, "%s: ", field_name);
             }
             print_avro_value(&field, indent + 1);
-            printf("\n");
+            fprintf(output, "\n");
         }
         print_indent(indent);
-        printf("}");
+        fprintf(output, "}");
         break;
     }
     case AVRO_UNION:
@@ -277,7 +405,7 @@ void print_field(avro_value_t *record, char *field) {
         avro_value_get_current_branch(record, &branch);
 
         if (avro_value_get_type(&branch) == AVRO_NULL) {
-            printf("<null branch>");
+            fprintf(output, "<null branch>");
             free(field_name);
             free(child);
             return;
@@ -291,7 +419,7 @@ void print_field(avro_value_t *record, char *field) {
     if (isdigit(*field_name)) {
         int index = atoi(field_name);
         if (index > size - 1) {
-            printf("<invalid array index>");
+            fprintf(output, "<invalid array index>");
             free(field_name);
             free(child);
             return;
@@ -309,7 +437,7 @@ void print_field(avro_value_t *record, char *field) {
         }
 
         if (!found) {
-            printf("<field not found>");
+            fprintf(output, "<field not found>");
             free(field_name);
             free(child);
             return;
@@ -324,23 +452,85 @@ void print_field(avro_value_t *record, char *field) {
     free(child);
 }
 
-// default avro file reader
-void read_avro_file_default(const char *filename, record_func callback, void *user_data) {
+// value at print_field path, unions unwrapped; 0 if found
+int get_field(avro_value_t *record, const char *field, avro_value_t *res) {
+    avro_value_t current = *record;
+    while (1) {
+        if (avro_value_get_type(&current) == AVRO_UNION) {
+            avro_value_t branch;
+            avro_value_get_current_branch(&current, &branch);
+            current = branch;
+        }
+
+        if (*field == ':' || *field == '.') {
+            field++;
+        }
+        if (!*field) {
+            break;
+        }
+
+        size_t field_name_len = strcspn(field, ":.");
+        size_t size = 0;
+        avro_value_t child;
+        avro_value_get_size(&current, &size);
+        if (isdigit(*field)) {
+            size_t index = atoi(field);
+            if (index >= size) {
+                return -1;
+            }
+            avro_value_get_by_index(&current, index, &child, NULL);
+        } else {
+            const char *f_name = NULL;
+            bool found = false;
+            for (int i = 0; i < size; i++) {
+                avro_value_get_by_index(&current, i, &child, &f_name);
+                if (f_name && strlen(f_name) == field_name_len &&
+                    strncmp(f_name, field, field_name_len) == 0) {
+                    found = true;
+                    break;
+                }
+            }
+            if (!found) {
+                return -1;
+            }
+        }
+
+        current = child;
+        field += field_name_len;
+    }
+
+    *res = current;
+    return 0;
+}
+
+// default avro file reader, -1 if the file is invalid or truncated
+int read_avro_file_default(const char *filename, record_func callback, void *user_data) {
     avro_file_reader_t reader;
     avro_value_iface_t *iface;
     avro_schema_t schema;
 
     FILE *fp = fopen(filename, "rb");
-    avro_file_reader_fp(fp, filename, 0, &reader);
+    if (!fp) {
+        return -1;
+    }
+    if (avro_file_reader_fp(fp, filename, 0, &reader) != 0) {
+        fprintf(stderr, "Invalid avro file %s.\n", filename);
+        fclose(fp);
+        return -1;
+    }
     schema = avro_file_reader_get_writer_schema(reader);
 
     iface = avro_generic_class_from_schema(schema);
 
+    int rval;
     while (1) {
         avro_value_t value;
         avro_generic_value_new(iface, &value);
-        int rval = avro_file_reader_read_value(reader, &value);
-        if (rval) break;
+        rval = avro_file_reader_read_value(reader, &value);
+        if (rval) {
+            avro_value_decref(&value);
+            break;
+        }
         callback(&value, user_data);
         avro_value_decref(&value);
     }
@@ -349,6 +539,12 @@ void read_avro_file_default(const char *filename, record_func callback, void *us
     avro_value_iface_decref(iface);
     avro_schema_decref(schema);
     fclose(fp);
+
+    if (rval != EOF) {
+        fprintf(stderr, "Invalid avro record.\n");
+        return -1;
+    }
+    return 0;
 }
 
 // custom avro file reader
@@ -1,3 +1,6 @@
+#ifndef LAQ_UTILS_H
+#define LAQ_UTILS_H
+
 #include <ctype.h>
 #include <fcntl.h>
 #include <stdbool.h>
@@ -12,13 +15,26 @@
 #include <zlib.h>
 
 #define CHUNK 10 * 1024 * 1024
+// nesting limit of serialized lua tables
+#define LUA_SERIALIZE_DEPTH 64
 
 typedef void (*record_func)(avro_value_t *, void *);
-typedef void (*reader_func)(const char *, record_func, void *);
 
+// handler output of the current thread
+extern __thread FILE *output;
+
+typedef int (*reader_func)(const char *, record_func, void *);
+
+uint64_t hash_bytes(const void *buf, size_t len, uint64_t seed);
 int inflate_buf(const char *src, char *dst, size_t len, size_t *out_len);
+int inflate_block(const char *src, size_t len, char **dst, size_t *cap, size_t *out_len);
 void read_varint(avro_reader_t reader, int64_t *res);
 void push_avro_value(lua_State *L, avro_value_t *value);
+int serialize_lua_value(lua_State *L, int idx, FILE *fp, int depth);
+void print_avro_value(avro_value_t *value, int indent);
 void print_field(avro_value_t *value, char *field);
+int get_field(avro_value_t *record, const char *field, avro_value_t *res);
 void read_avro_file_custom(const char *filename, record_func callback, void *user_data);
-void read_avro_file_default(const char *filename, record_func callback, void *user_data);
+int read_avro_file_default(const char *filename, record_func callback, void *user_data);
+
+#endif